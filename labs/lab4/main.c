@@ -1,75 +1,373 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "shop_stats.h"
+
+#define DEFAULT_ARRIVAL_SPEC "uniform:500"
+#define DEFAULT_SERVICE_SPEC "fixed:1000"
+#define SERVICE_SEED_SALT 0x9e3779b97f4a7c15ull
+#define WAIT_WINDOW 256
+#define CONTROL_INTERVAL_NS 250000000ull
+#define CONTROL_GROW_HEADROOM 0.8
+#define CONTROL_MIN_SAMPLES 16
+#define CONTROL_COOLDOWN_PERIODS 4
+
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_EXP, DIST_HYPER } DistKind;
+typedef enum { QUEUE_SEM, QUEUE_FIFO } QueueKind;
+
 typedef struct {
+  DistKind kind;
+  double param_ms;
+} Distribution;
+
+typedef struct {
+  Distribution arrival;
+  bool arrival_gaps;
+  Distribution service;
+  uint64_t seed;
+  bool quiet;
+  bool virtual_time;
+  QueueKind queue;
+  bool adaptive;
+  uint64_t target_p99_ns;
+  const char *shm_name;
+} Options;
+
+/* Most recent waits, written only by the barber and read by the controller. */
+typedef struct {
+  _Atomic uint64_t samples[WAIT_WINDOW];
+  atomic_size_t recorded;
+} WaitWindow;
+
+/* Process-local state of the chair controller (adaptive mode). */
+typedef struct {
+  int max_chairs;
+  size_t last_recorded;
+  size_t change_recorded;
+  int cooldown;
+  int last_arrivals;
+  int last_turned_away;
+  uint64_t scratch[WAIT_WINDOW];
+} Controller;
+
+/* A waiting chair in FIFO mode: its owner blocks on its own semaphore. */
+typedef struct {
+  sem_t called;
+  int customer_id;
+} Ticket;
+
+typedef struct {
+  ShopStats stats; /* must stay first: the monitor maps only this block */
   int waiting_customers;
   int chairs;
   int shutdown;
+  int in_chair;
+  int barber_busy;
+  int served;
   sem_t mutex;
   sem_t customer_sem;
   sem_t barber_sem;
+  sem_t chair_sem;
+  int arrivals;
+  int turned_away;
+  WaitWindow waits;
+  size_t ticket_head;
+  size_t ticket_tail;
+  size_t ticket_slots;
+  Ticket tickets[];
 } SharedData;
 
-static void barber(SharedData *shared);
-static void customer(SharedData *shared, int customer_id);
+/* One slot per customer; every field has a single writer, so no lock. */
+typedef struct {
+  uint64_t arrival_ns;
+  uint64_t seated_ns;
+  uint64_t service_start_ns;
+  uint64_t service_end_ns;
+  int turned_away;
+} CustomerRecord;
+
+typedef enum { EVENT_ARRIVAL, EVENT_SERVICE_DONE, EVENT_CONTROL } EventType;
+
+typedef struct {
+  uint64_t time_ns;
+  uint64_t seq;
+  EventType type;
+  int customer_id;
+} Event;
+
+typedef struct {
+  Event *items;
+  size_t count;
+  size_t capacity;
+  uint64_t next_seq;
+} EventHeap;
+
+static Options g_options;
+
+static int run_realtime(int chairs, int total_customers,
+                        CustomerRecord *records, const uint64_t *arrivals);
+static void run_virtual(int chairs, int total_customers,
+                        CustomerRecord *records, const uint64_t *arrivals);
+static void barber(SharedData *shared, CustomerRecord *records);
+static void customer(SharedData *shared, CustomerRecord *records,
+                     int customer_id);
+static void controller_process(SharedData *shared, int max_chairs);
+static int controller_step(Controller *controller, const WaitWindow *waits,
+                           int arrivals, int turned_away, int chairs);
+static void window_push(WaitWindow *waits, uint64_t wait_ns);
+static void publish_stats(SharedData *shared);
+static SharedData *map_shared(size_t size);
+static void unmap_shared(SharedData *shared, size_t size);
+static uint64_t *plan_arrivals(int total, uint64_t *rng);
+
+static void heap_push(EventHeap *heap, uint64_t time_ns, EventType type,
+                      int customer_id);
+static bool heap_pop(EventHeap *heap, Event *out);
+static bool event_before(const Event *a, const Event *b);
+
+static uint64_t rng_next(uint64_t *state);
+static uint64_t sample_ns(const Distribution *dist, uint64_t *rng);
+static int parse_distribution(const char *text, const char *label,
+                              Distribution *out, bool *gaps_out);
+
+static void print_report(const CustomerRecord *records, int total);
+static int count_overtaken(const CustomerRecord *records, int total);
+static int compare_seated(const void *a, const void *b);
+static void print_percentiles(const char *label, uint64_t *samples,
+                              size_t count);
+static int compare_u64(const void *a, const void *b);
+static uint64_t now_ns(void);
+static void sleep_until_ns(uint64_t deadline_ns);
+static void shop_log(const char *fmt, ...);
+static void usage(const char *prog);
 static int parse_nonneg_int(const char *text, const char *label,
                             int *value_out);
 static void safe_sem_wait(sem_t *sem);
 static void safe_sem_post(sem_t *sem);
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <number_of_chairs> <number_of_customers>\n",
-            argv[0]);
+  g_options.seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 16);
+  parse_distribution(DEFAULT_ARRIVAL_SPEC, "arrival", &g_options.arrival,
+                     &g_options.arrival_gaps);
+  parse_distribution(DEFAULT_SERVICE_SPEC, "service", &g_options.service,
+                     NULL);
+
+  static const struct option long_options[] = {
+      {"virtual", no_argument, NULL, 'V'},
+      {"arrival", required_argument, NULL, 'a'},
+      {"service", required_argument, NULL, 's'},
+      {"seed", required_argument, NULL, 'S'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"queue", required_argument, NULL, 'Q'},
+      {"adaptive", required_argument, NULL, 'A'},
+      {"shm-name", required_argument, NULL, 'N'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "Va:s:S:qQ:A:N:", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'V':
+      g_options.virtual_time = true;
+      break;
+    case 'a':
+      if (parse_distribution(optarg, "arrival", &g_options.arrival,
+                             &g_options.arrival_gaps) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      if (parse_distribution(optarg, "service", &g_options.service, NULL) !=
+          0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'S': {
+      char *end = NULL;
+      errno = 0;
+      g_options.seed = strtoull(optarg, &end, 10);
+      if (errno != 0 || end == optarg || *end != '\0') {
+        fprintf(stderr, "Invalid seed: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'q':
+      g_options.quiet = true;
+      break;
+    case 'Q':
+      if (strcmp(optarg, "sem") == 0) {
+        g_options.queue = QUEUE_SEM;
+      } else if (strcmp(optarg, "fifo") == 0) {
+        g_options.queue = QUEUE_FIFO;
+      } else {
+        fprintf(stderr, "Invalid queue: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'A': {
+      char *end = NULL;
+      double target_ms = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(target_ms > 0.0)) {
+        fprintf(stderr, "Invalid target p99 wait: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      g_options.adaptive = true;
+      g_options.target_p99_ns = (uint64_t)(target_ms * 1e6);
+      break;
+    }
+    case 'N':
+      if (optarg[0] != '/' || strchr(optarg + 1, '/') != NULL) {
+        fprintf(stderr, "Shared memory name must look like /name: %s\n",
+                optarg);
+        return EXIT_FAILURE;
+      }
+      g_options.shm_name = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (g_options.shm_name && g_options.virtual_time) {
+    fprintf(stderr, "--shm-name needs the real-time mode\n");
+    return EXIT_FAILURE;
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   int chairs = 0;
   int total_customers = 0;
-  if (parse_nonneg_int(argv[1], "number_of_chairs", &chairs) != 0 ||
-      parse_nonneg_int(argv[2], "number_of_customers", &total_customers) != 0) {
+  if (parse_nonneg_int(argv[optind], "number_of_chairs", &chairs) != 0 ||
+      parse_nonneg_int(argv[optind + 1], "number_of_customers",
+                       &total_customers) != 0) {
     return EXIT_FAILURE;
   }
 
-  SharedData *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
-                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-  if (shared == MAP_FAILED) {
-    perror("mmap");
+  size_t records_size = (size_t)(total_customers > 0 ? total_customers : 1) *
+                        sizeof(CustomerRecord);
+  CustomerRecord *records = mmap(NULL, records_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (records == MAP_FAILED) {
+    perror("mmap records");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t rng = g_options.seed;
+  uint64_t *arrivals = plan_arrivals(total_customers, &rng);
+  if (!arrivals) {
+    munmap(records, records_size);
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  if (g_options.virtual_time) {
+    run_virtual(chairs, total_customers, records, arrivals);
+  } else {
+    status = run_realtime(chairs, total_customers, records, arrivals);
+  }
+
+  if (status == EXIT_SUCCESS) {
+    printf("Simulation complete.\n");
+    print_report(records, total_customers);
+  }
+
+  free(arrivals);
+  munmap(records, records_size);
+  return status;
+}
+
+static int run_realtime(int chairs, int total_customers,
+                        CustomerRecord *records, const uint64_t *arrivals) {
+  size_t ticket_slots = (size_t)(chairs > 0 ? chairs : 1);
+  size_t shared_size = sizeof(SharedData) + ticket_slots * sizeof(Ticket);
+  SharedData *shared = map_shared(shared_size);
+  if (!shared) {
     return EXIT_FAILURE;
   }
 
+  shared->stats.magic = SHOP_STATS_MAGIC;
+  shared->stats.version = SHOP_STATS_VERSION;
+  shared->stats.start_ns = now_ns();
   shared->waiting_customers = 0;
   shared->chairs = chairs;
   shared->shutdown = 0;
+  shared->in_chair = 0;
+  shared->barber_busy = 0;
+  shared->served = 0;
+  shared->arrivals = 0;
+  shared->turned_away = 0;
+  atomic_init(&shared->waits.recorded, 0);
+  shared->ticket_head = 0;
+  shared->ticket_tail = 0;
+  shared->ticket_slots = ticket_slots;
 
   if (sem_init(&shared->mutex, 1, 1) == -1 ||
       sem_init(&shared->customer_sem, 1, 0) == -1 ||
-      sem_init(&shared->barber_sem, 1, 0) == -1) {
+      sem_init(&shared->barber_sem, 1, 0) == -1 ||
+      sem_init(&shared->chair_sem, 1, 0) == -1) {
     perror("sem_init");
-    munmap(shared, sizeof(*shared));
+    unmap_shared(shared, shared_size);
     return EXIT_FAILURE;
   }
+  for (size_t i = 0; i < ticket_slots; i++) {
+    if (sem_init(&shared->tickets[i].called, 1, 0) == -1) {
+      perror("sem_init");
+      unmap_shared(shared, shared_size);
+      return EXIT_FAILURE;
+    }
+  }
+  publish_stats(shared);
 
+  fflush(stdout);
   pid_t barber_pid = fork();
   if (barber_pid < 0) {
     perror("fork");
-    munmap(shared, sizeof(*shared));
+    unmap_shared(shared, shared_size);
     return EXIT_FAILURE;
   }
 
   if (barber_pid == 0) {
-    barber(shared);
+    barber(shared, records);
     exit(EXIT_SUCCESS);
   }
 
+  pid_t controller_pid = 0;
+  if (g_options.adaptive) {
+    controller_pid = fork();
+    if (controller_pid < 0) {
+      perror("fork");
+      return EXIT_FAILURE;
+    }
+    if (controller_pid == 0) {
+      controller_process(shared, chairs);
+      exit(EXIT_SUCCESS);
+    }
+  }
+
   pid_t *customer_pids = NULL;
   if (total_customers > 0) {
     customer_pids = calloc((size_t)total_customers, sizeof(*customer_pids));
@@ -79,6 +377,7 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  uint64_t start_ns = now_ns();
   for (int i = 0; i < total_customers; i++) {
     pid_t customer_pid = fork();
     if (customer_pid < 0) {
@@ -86,9 +385,8 @@ int main(int argc, char *argv[]) {
       return EXIT_FAILURE;
     }
     if (customer_pid == 0) {
-      srand((unsigned int)(time(NULL) ^ (getpid() << 16)));
-      usleep((useconds_t)(rand() % 500000));
-      customer(shared, i + 1);
+      sleep_until_ns(start_ns + arrivals[i]);
+      customer(shared, records, i + 1);
       exit(EXIT_SUCCESS);
     }
     customer_pids[i] = customer_pid;
@@ -109,6 +407,7 @@ int main(int argc, char *argv[]) {
 
   safe_sem_wait(&shared->mutex);
   shared->shutdown = 1;
+  publish_stats(shared);
   safe_sem_post(&shared->mutex);
   safe_sem_post(&shared->customer_sem);
 
@@ -120,17 +419,122 @@ int main(int argc, char *argv[]) {
     break;
   }
 
+  while (controller_pid > 0 && waitpid(controller_pid, NULL, 0) == -1) {
+    if (errno == EINTR) {
+      continue;
+    }
+    perror("waitpid");
+    break;
+  }
+
   sem_destroy(&shared->mutex);
   sem_destroy(&shared->customer_sem);
   sem_destroy(&shared->barber_sem);
-  munmap(shared, sizeof(*shared));
-
-  printf("Simulation complete.\n");
+  sem_destroy(&shared->chair_sem);
+  for (size_t i = 0; i < ticket_slots; i++) {
+    sem_destroy(&shared->tickets[i].called);
+  }
+  unmap_shared(shared, shared_size);
   return EXIT_SUCCESS;
 }
 
-static void barber(SharedData *shared) {
-  printf("Barber: Starting work. Waiting for customers...\n");
+/*
+ * Discrete-event replay of the same shop: one barber, a FIFO of waiting
+ * chairs and the same admission rule (sit only if a waiting chair is free).
+ * Time jumps from event to event, so no process ever sleeps.
+ */
+static void run_virtual(int chairs, int total_customers,
+                        CustomerRecord *records, const uint64_t *arrivals) {
+  EventHeap heap = {NULL, 0, 0, 0};
+  int *queue = calloc((size_t)(chairs > 0 ? chairs : 1), sizeof(*queue));
+  if (!queue) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  WaitWindow *waits = calloc(1, sizeof(*waits));
+  Controller *controller = calloc(1, sizeof(*controller));
+  if (!waits || !controller) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  controller->max_chairs = chairs;
+
+  uint64_t rng = g_options.seed ^ SERVICE_SEED_SALT;
+  size_t queue_head = 0;
+  int queue_count = 0;
+  int capacity = chairs;
+  int in_chair = 0;
+  int arrived = 0;
+  int turned_away = 0;
+
+  if (total_customers > 0) {
+    heap_push(&heap, arrivals[0], EVENT_ARRIVAL, 1);
+    if (g_options.adaptive) {
+      heap_push(&heap, CONTROL_INTERVAL_NS, EVENT_CONTROL, 0);
+    }
+  }
+
+  Event event;
+  while (heap_pop(&heap, &event)) {
+    uint64_t now = event.time_ns;
+    if (event.type == EVENT_CONTROL) {
+      capacity =
+          controller_step(controller, waits, arrived, turned_away, capacity);
+      if (arrived < total_customers || queue_count > 0 || in_chair != 0) {
+        heap_push(&heap, now + CONTROL_INTERVAL_NS, EVENT_CONTROL, 0);
+      }
+      continue;
+    }
+
+    if (event.type == EVENT_ARRIVAL) {
+      CustomerRecord *record = &records[event.customer_id - 1];
+      record->arrival_ns = now;
+      arrived++;
+      if (event.customer_id < total_customers) {
+        heap_push(&heap, arrivals[event.customer_id], EVENT_ARRIVAL,
+                  event.customer_id + 1);
+      }
+      if (queue_count >= capacity) {
+        record->turned_away = 1;
+        turned_away++;
+        continue;
+      }
+      record->seated_ns = now;
+      queue[(queue_head + (size_t)queue_count) % (size_t)chairs] =
+          event.customer_id;
+      queue_count++;
+      if (in_chair != 0) {
+        continue;
+      }
+    } else {
+      records[in_chair - 1].service_end_ns = now;
+      in_chair = 0;
+      if (queue_count == 0) {
+        continue;
+      }
+    }
+
+    in_chair = queue[queue_head];
+    queue_head = (queue_head + 1) % (size_t)chairs;
+    queue_count--;
+    CustomerRecord *record = &records[in_chair - 1];
+    record->service_start_ns = now;
+    window_push(waits, record->service_start_ns - record->seated_ns);
+    heap_push(&heap, now + sample_ns(&g_options.service, &rng),
+              EVENT_SERVICE_DONE, in_chair);
+  }
+
+  free(heap.items);
+  free(queue);
+  free(waits);
+  free(controller);
+}
+
+static void barber(SharedData *shared, CustomerRecord *records) {
+  uint64_t rng = g_options.seed ^ SERVICE_SEED_SALT;
+
+  shop_log("Barber: Starting work. Waiting for customers...\n");
   for (;;) {
     safe_sem_wait(&shared->customer_sem);
 
@@ -140,38 +544,554 @@ static void barber(SharedData *shared) {
       break;
     }
 
-    shared->waiting_customers--;
-    printf("Barber: Starting haircut. Waiting customers: %d\n",
-           shared->waiting_customers);
-    safe_sem_post(&shared->barber_sem);
-    safe_sem_post(&shared->mutex);
+    if (g_options.queue == QUEUE_FIFO) {
+      /*
+       * Call the oldest ticket. Its chair is only released once the owner
+       * has woken, so the slot cannot be handed out again before then.
+       */
+      Ticket *ticket =
+          &shared->tickets[shared->ticket_head % shared->ticket_slots];
+      shared->ticket_head++;
+      shared->barber_busy = 1;
+      publish_stats(shared);
+      shop_log("Barber: Calling customer %d.\n", ticket->customer_id);
+      safe_sem_post(&ticket->called);
+      safe_sem_post(&shared->mutex);
+
+      safe_sem_wait(&shared->chair_sem);
+      safe_sem_wait(&shared->mutex);
+      shared->waiting_customers--;
+      publish_stats(shared);
+      shop_log("Barber: Starting haircut. Waiting customers: %d\n",
+               shared->waiting_customers);
+      safe_sem_post(&shared->mutex);
+    } else {
+      shared->waiting_customers--;
+      shared->barber_busy = 1;
+      publish_stats(shared);
+      shop_log("Barber: Starting haircut. Waiting customers: %d\n",
+               shared->waiting_customers);
+      safe_sem_post(&shared->barber_sem);
+      safe_sem_post(&shared->mutex);
 
-    sleep(1);
-    printf("Barber: Finished haircut.\n");
+      /* Whoever won barber_sem tells us who is in the chair. */
+      safe_sem_wait(&shared->chair_sem);
+    }
+    CustomerRecord *record = &records[shared->in_chair - 1];
+    window_push(&shared->waits, record->service_start_ns - record->seated_ns);
+
+    sleep_until_ns(now_ns() + sample_ns(&g_options.service, &rng));
+    record->service_end_ns = now_ns();
+
+    safe_sem_wait(&shared->mutex);
+    shared->barber_busy = 0;
+    shared->served++;
+    publish_stats(shared);
+    safe_sem_post(&shared->mutex);
+    shop_log("Barber: Finished haircut.\n");
   }
 
-  printf("Barber: Closing shop.\n");
+  shop_log("Barber: Closing shop.\n");
 }
 
-static void customer(SharedData *shared, int customer_id) {
-  printf("Customer %d: Arrived at the barbershop.\n", customer_id);
+static void customer(SharedData *shared, CustomerRecord *records,
+                     int customer_id) {
+  CustomerRecord *record = &records[customer_id - 1];
+  record->arrival_ns = now_ns();
+  shop_log("Customer %d: Arrived at the barbershop.\n", customer_id);
 
   safe_sem_wait(&shared->mutex);
+  shared->arrivals++;
   if (shared->waiting_customers < shared->chairs) {
+    record->seated_ns = now_ns();
     shared->waiting_customers++;
-    printf("Customer %d: Sitting in waiting area. Waiting customers: %d\n",
-           customer_id, shared->waiting_customers);
+    shop_log("Customer %d: Sitting in waiting area. Waiting customers: %d\n",
+             customer_id, shared->waiting_customers);
+    Ticket *ticket = NULL;
+    if (g_options.queue == QUEUE_FIFO) {
+      ticket = &shared->tickets[shared->ticket_tail % shared->ticket_slots];
+      shared->ticket_tail++;
+      ticket->customer_id = customer_id;
+    }
+    publish_stats(shared);
     safe_sem_post(&shared->customer_sem);
     safe_sem_post(&shared->mutex);
 
-    safe_sem_wait(&shared->barber_sem);
-    printf("Customer %d: Getting a haircut.\n", customer_id);
-    printf("Customer %d: Haircut done, paying at the cashier.\n", customer_id);
+    safe_sem_wait(ticket ? &ticket->called : &shared->barber_sem);
+    record->service_start_ns = now_ns();
+    shared->in_chair = customer_id;
+    safe_sem_post(&shared->chair_sem);
+    shop_log("Customer %d: Getting a haircut.\n", customer_id);
+    shop_log("Customer %d: Haircut done, paying at the cashier.\n",
+             customer_id);
     return;
   }
 
+  record->turned_away = 1;
+  shared->turned_away++;
+  publish_stats(shared);
   safe_sem_post(&shared->mutex);
-  printf("Customer %d: No available chairs. Leaving the shop.\n", customer_id);
+  shop_log("Customer %d: No available chairs. Leaving the shop.\n",
+           customer_id);
+}
+
+static void controller_process(SharedData *shared, int max_chairs) {
+  Controller *controller = calloc(1, sizeof(*controller));
+  if (!controller) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  controller->max_chairs = max_chairs;
+
+  for (;;) {
+    sleep_until_ns(now_ns() + CONTROL_INTERVAL_NS);
+
+    safe_sem_wait(&shared->mutex);
+    if (shared->shutdown) {
+      safe_sem_post(&shared->mutex);
+      break;
+    }
+    int arrivals = shared->arrivals;
+    int turned_away = shared->turned_away;
+    int chairs = shared->chairs;
+    safe_sem_post(&shared->mutex);
+
+    int next =
+        controller_step(controller, &shared->waits, arrivals, turned_away,
+                        chairs);
+    if (next != chairs) {
+      safe_sem_wait(&shared->mutex);
+      shared->chairs = next;
+      publish_stats(shared);
+      safe_sem_post(&shared->mutex);
+    }
+  }
+
+  free(controller);
+}
+
+/*
+ * One control period: shrink the waiting room while the rolling p99 wait is
+ * over target, grow it back while customers are being turned away and the
+ * p99 has headroom. After a change it holds for a few periods and then judges
+ * only waits recorded since, so it never reacts twice to the same backlog.
+ * Returns the new chair count.
+ */
+static int controller_step(Controller *controller, const WaitWindow *waits,
+                           int arrivals, int turned_away, int chairs) {
+  size_t recorded =
+      atomic_load_explicit(&waits->recorded, memory_order_acquire);
+  int period_arrivals = arrivals - controller->last_arrivals;
+  int period_turned_away = turned_away - controller->last_turned_away;
+  bool new_waits = recorded != controller->last_recorded;
+  controller->last_recorded = recorded;
+  controller->last_arrivals = arrivals;
+  controller->last_turned_away = turned_away;
+  if (controller->cooldown > 0) {
+    controller->cooldown--;
+    return chairs;
+  }
+  if (!new_waits && period_turned_away == 0) {
+    return chairs;
+  }
+
+  size_t count = recorded - controller->change_recorded;
+  if (count < CONTROL_MIN_SAMPLES) {
+    return chairs;
+  }
+  if (count > WAIT_WINDOW) {
+    count = WAIT_WINDOW;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t slot = (recorded - count + i) % WAIT_WINDOW;
+    controller->scratch[i] =
+        atomic_load_explicit(&waits->samples[slot], memory_order_relaxed);
+  }
+  qsort(controller->scratch, count, sizeof(controller->scratch[0]),
+        compare_u64);
+  uint64_t p99 = controller->scratch[(count * 99 + 99) / 100 - 1];
+
+  int next = chairs;
+  if (p99 > g_options.target_p99_ns && chairs > 1) {
+    next = chairs - 1;
+  } else if (period_turned_away > 0 && chairs < controller->max_chairs &&
+             p99 < (uint64_t)(g_options.target_p99_ns *
+                              CONTROL_GROW_HEADROOM)) {
+    next = chairs + 1;
+  }
+
+  if (next != chairs) {
+    printf("Controller: chairs %d -> %d (p99 wait %.3f ms over %zu samples, "
+           "target %.3f ms, turned away %d/%d this period)\n",
+           chairs, next, p99 / 1e6, count, g_options.target_p99_ns / 1e6,
+           period_turned_away, period_arrivals);
+    controller->change_recorded = recorded;
+    controller->cooldown = CONTROL_COOLDOWN_PERIODS;
+  }
+  return next;
+}
+
+static void window_push(WaitWindow *waits, uint64_t wait_ns) {
+  size_t recorded = atomic_load_explicit(&waits->recorded, memory_order_relaxed);
+  atomic_store_explicit(&waits->samples[recorded % WAIT_WINDOW], wait_ns,
+                        memory_order_relaxed);
+  atomic_store_explicit(&waits->recorded, recorded + 1, memory_order_release);
+}
+
+/* Copies the shop counters into the seqlock block; caller holds the mutex. */
+static void publish_stats(SharedData *shared) {
+  ShopStatsSnapshot snap = {
+      .chairs = shared->chairs,
+      .waiting = shared->waiting_customers,
+      .barber_busy = shared->barber_busy,
+      .arrivals = shared->arrivals,
+      .served = shared->served,
+      .turned_away = shared->turned_away,
+      .closed = shared->shutdown,
+  };
+  shop_stats_publish(&shared->stats, &snap);
+}
+
+/*
+ * Anonymous mapping by default; with --shm-name the shop lives in a named
+ * POSIX shared memory object so that tools outside the process tree can
+ * attach to it.
+ */
+static SharedData *map_shared(size_t size) {
+  int fd = -1;
+  int flags = MAP_SHARED | MAP_ANONYMOUS;
+  if (g_options.shm_name) {
+    fd = shm_open(g_options.shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+      perror("shm_open");
+      return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) == -1) {
+      perror("ftruncate");
+      close(fd);
+      shm_unlink(g_options.shm_name);
+      return NULL;
+    }
+    flags = MAP_SHARED;
+  }
+
+  SharedData *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    if (g_options.shm_name) {
+      shm_unlink(g_options.shm_name);
+    }
+    return NULL;
+  }
+  return shared;
+}
+
+static void unmap_shared(SharedData *shared, size_t size) {
+  munmap(shared, size);
+  if (g_options.shm_name) {
+    shm_unlink(g_options.shm_name);
+  }
+}
+
+/*
+ * Arrival offsets from the start of the run, sorted so that customer ids
+ * follow arrival order in both modes.
+ */
+static uint64_t *plan_arrivals(int total, uint64_t *rng) {
+  uint64_t *arrivals =
+      calloc((size_t)(total > 0 ? total : 1), sizeof(*arrivals));
+  if (!arrivals) {
+    perror("calloc arrivals");
+    return NULL;
+  }
+
+  uint64_t clock = 0;
+  for (int i = 0; i < total; i++) {
+    uint64_t sample = sample_ns(&g_options.arrival, rng);
+    if (g_options.arrival_gaps) {
+      clock += sample;
+      arrivals[i] = clock;
+    } else {
+      arrivals[i] = sample;
+    }
+  }
+
+  if (!g_options.arrival_gaps) {
+    qsort(arrivals, (size_t)total, sizeof(*arrivals), compare_u64);
+  }
+  return arrivals;
+}
+
+static void heap_push(EventHeap *heap, uint64_t time_ns, EventType type,
+                      int customer_id) {
+  if (heap->count == heap->capacity) {
+    size_t capacity = heap->capacity ? heap->capacity * 2 : 16;
+    Event *items = realloc(heap->items, capacity * sizeof(*items));
+    if (!items) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    heap->items = items;
+    heap->capacity = capacity;
+  }
+
+  Event event = {time_ns, heap->next_seq++, type, customer_id};
+  size_t i = heap->count++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!event_before(&event, &heap->items[parent])) {
+      break;
+    }
+    heap->items[i] = heap->items[parent];
+    i = parent;
+  }
+  heap->items[i] = event;
+}
+
+static bool heap_pop(EventHeap *heap, Event *out) {
+  if (heap->count == 0) {
+    return false;
+  }
+
+  *out = heap->items[0];
+  Event last = heap->items[--heap->count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= heap->count) {
+      break;
+    }
+    if (child + 1 < heap->count &&
+        event_before(&heap->items[child + 1], &heap->items[child])) {
+      child++;
+    }
+    if (!event_before(&heap->items[child], &last)) {
+      break;
+    }
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return true;
+}
+
+static bool event_before(const Event *a, const Event *b) {
+  if (a->time_ns != b->time_ns) {
+    return a->time_ns < b->time_ns;
+  }
+  return a->seq < b->seq;
+}
+
+/* splitmix64: tiny, seedable and identical in every process. */
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t sample_ns(const Distribution *dist, uint64_t *rng) {
+  double unit = (double)(rng_next(rng) >> 11) / 9007199254740992.0;
+  double ms = dist->param_ms;
+  if (dist->kind == DIST_UNIFORM) {
+    ms *= unit;
+  } else if (dist->kind == DIST_EXP) {
+    ms *= -log1p(-unit);
+  } else if (dist->kind == DIST_HYPER) {
+    /* Balanced two-phase hyperexponential: mostly short gaps, rare long. */
+    double branch = (double)(rng_next(rng) >> 11) / 9007199254740992.0;
+    ms *= branch < 0.9 ? -log1p(-unit) / 1.8 : -log1p(-unit) * 5.0;
+  }
+  return (uint64_t)(ms * 1e6 + 0.5);
+}
+
+/*
+ * Accepted forms:
+ *   fixed:MS      constant duration (arrivals: one every MS)
+ *   uniform:MS    uniform in [0, MS) (arrivals: offset from start)
+ *   exp:MS        exponential with mean MS
+ *   poisson:RATE  arrivals only, RATE customers per second
+ *   bursty:RATE   arrivals only, RATE per second with hyperexponential gaps
+ */
+static int parse_distribution(const char *text, const char *label,
+                              Distribution *out, bool *gaps_out) {
+  const char *colon = strchr(text, ':');
+  char *end = NULL;
+  double value = colon ? strtod(colon + 1, &end) : 0.0;
+  if (!colon || end == colon + 1 || *end != '\0' || !(value > 0.0)) {
+    fprintf(stderr, "Invalid %s distribution: %s\n", label, text);
+    return -1;
+  }
+
+  size_t name_len = (size_t)(colon - text);
+  Distribution dist = {DIST_FIXED, value};
+  bool gaps = true;
+  if (name_len == 5 && strncmp(text, "fixed", 5) == 0) {
+    dist.kind = DIST_FIXED;
+  } else if (name_len == 7 && strncmp(text, "uniform", 7) == 0) {
+    dist.kind = DIST_UNIFORM;
+    gaps = false;
+  } else if (name_len == 3 && strncmp(text, "exp", 3) == 0) {
+    dist.kind = DIST_EXP;
+  } else if (gaps_out && name_len == 7 && strncmp(text, "poisson", 7) == 0) {
+    dist.kind = DIST_EXP;
+    dist.param_ms = 1000.0 / value;
+  } else if (gaps_out && name_len == 6 && strncmp(text, "bursty", 6) == 0) {
+    dist.kind = DIST_HYPER;
+    dist.param_ms = 1000.0 / value;
+  } else {
+    fprintf(stderr, "Invalid %s distribution: %s\n", label, text);
+    return -1;
+  }
+
+  *out = dist;
+  if (gaps_out) {
+    *gaps_out = gaps;
+  }
+  return 0;
+}
+
+static void print_report(const CustomerRecord *records, int total) {
+  size_t capacity = (size_t)(total > 0 ? total : 1);
+  uint64_t *waits = calloc(capacity, sizeof(*waits));
+  uint64_t *services = calloc(capacity, sizeof(*services));
+  if (!waits || !services) {
+    perror("calloc");
+    free(waits);
+    free(services);
+    return;
+  }
+
+  size_t served = 0;
+  int turned_away = 0;
+  for (int i = 0; i < total; i++) {
+    if (records[i].turned_away) {
+      turned_away++;
+      continue;
+    }
+    waits[served] = records[i].service_start_ns - records[i].seated_ns;
+    services[served] = records[i].service_end_ns - records[i].service_start_ns;
+    served++;
+  }
+
+  printf("\nStatistics for %d customers:\n", total);
+  printf("  served: %zu, turned away: %d (%.2f%%), overtaken: %d\n", served,
+         turned_away, total > 0 ? 100.0 * turned_away / total : 0.0,
+         count_overtaken(records, total));
+  print_percentiles("wait", waits, served);
+  print_percentiles("service", services, served);
+
+  free(waits);
+  free(services);
+}
+
+/*
+ * Served customers that were called after someone who sat down later than
+ * they did, i.e. how often the queue discipline broke arrival order.
+ */
+static int count_overtaken(const CustomerRecord *records, int total) {
+  const CustomerRecord **seated =
+      calloc((size_t)(total > 0 ? total : 1), sizeof(*seated));
+  if (!seated) {
+    perror("calloc");
+    return 0;
+  }
+
+  size_t count = 0;
+  for (int i = 0; i < total; i++) {
+    if (!records[i].turned_away) {
+      seated[count++] = &records[i];
+    }
+  }
+  qsort(seated, count, sizeof(*seated), compare_seated);
+
+  int overtaken = 0;
+  uint64_t earliest_later_start = UINT64_MAX;
+  for (size_t i = count; i-- > 0;) {
+    if (earliest_later_start < seated[i]->service_start_ns) {
+      overtaken++;
+    } else {
+      earliest_later_start = seated[i]->service_start_ns;
+    }
+  }
+
+  free(seated);
+  return overtaken;
+}
+
+static int compare_seated(const void *a, const void *b) {
+  const CustomerRecord *lhs = *(const CustomerRecord *const *)a;
+  const CustomerRecord *rhs = *(const CustomerRecord *const *)b;
+  return (lhs->seated_ns > rhs->seated_ns) - (lhs->seated_ns < rhs->seated_ns);
+}
+
+static void print_percentiles(const char *label, uint64_t *samples,
+                              size_t count) {
+  if (count == 0) {
+    printf("  %-8s (ms): no samples\n", label);
+    return;
+  }
+
+  qsort(samples, count, sizeof(*samples), compare_u64);
+  static const int ranks[] = {50, 90, 99};
+  printf("  %-8s (ms):", label);
+  for (size_t i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++) {
+    size_t index = (count * (size_t)ranks[i] + 99) / 100 - 1;
+    printf(" p%d %.3f", ranks[i], samples[index] / 1e6);
+  }
+  printf(" max %.3f\n", samples[count - 1] / 1e6);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t lhs = *(const uint64_t *)a;
+  uint64_t rhs = *(const uint64_t *)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline_ns) {
+  struct timespec ts = {(time_t)(deadline_ns / 1000000000ull),
+                        (long)(deadline_ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static void shop_log(const char *fmt, ...) {
+  if (g_options.quiet) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <number_of_chairs> <number_of_customers>\n"
+          "  -V, --virtual        discrete-event mode on a virtual clock\n"
+          "  -a, --arrival SPEC   uniform:MS | poisson:RATE | bursty:RATE | "
+          "fixed:MS | exp:MS\n"
+          "                       (default " DEFAULT_ARRIVAL_SPEC ")\n"
+          "  -s, --service SPEC   fixed:MS | uniform:MS | exp:MS "
+          "(default " DEFAULT_SERVICE_SPEC ")\n"
+          "  -S, --seed N         seed for arrivals and service times\n"
+          "  -Q, --queue KIND     sem (shared barber_sem) or fifo (ticket "
+          "per chair)\n"
+          "  -A, --adaptive MS    adjust chairs (up to the given count) to "
+          "hold p99 wait\n"
+          "  -N, --shm-name NAME  place the shop in shm_open(NAME) for "
+          "barber_monitor\n"
+          "  -q, --quiet          only print the final statistics\n",
+          prog);
 }
 
 static int parse_nonneg_int(const char *text, const char *label,
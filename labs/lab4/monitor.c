@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shop_stats.h"
+
+#define DEFAULT_SAMPLE_US 1000
+#define DEFAULT_REPORT_MS 1000
+
+typedef struct {
+  uint64_t samples;
+  uint64_t retries;
+  int64_t occupancy_min;
+  int64_t occupancy_max;
+  int64_t occupancy_sum;
+  int64_t queue_min;
+  int64_t queue_max;
+  int64_t queue_sum;
+} Period;
+
+static void period_reset(Period *period);
+static void period_add(Period *period, const ShopStatsSnapshot *snap,
+                       unsigned retries);
+static uint64_t now_ns(void);
+static void sleep_until_ns(uint64_t deadline_ns);
+static int parse_positive_int(const char *text, const char *label,
+                              int *value_out);
+
+int main(int argc, char *argv[]) {
+  int sample_us = DEFAULT_SAMPLE_US;
+  int report_ms = DEFAULT_REPORT_MS;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:r:")) != -1) {
+    switch (opt) {
+    case 'i':
+      if (parse_positive_int(optarg, "sample interval", &sample_us) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'r':
+      if (parse_positive_int(optarg, "report interval", &report_ms) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-i sample_us] [-r report_ms] /shm-name\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, "Usage: %s [-i sample_us] [-r report_ms] /shm-name\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *name = argv[optind];
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) {
+    perror("shm_open");
+    return EXIT_FAILURE;
+  }
+
+  const ShopStats *stats =
+      mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (stats == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+
+  if (stats->magic != SHOP_STATS_MAGIC ||
+      stats->version != SHOP_STATS_VERSION) {
+    fprintf(stderr, "%s is not a barbershop statistics segment\n", name);
+    munmap((void *)stats, sizeof(*stats));
+    return EXIT_FAILURE;
+  }
+
+  printf("%9s %6s %12s %12s %9s %9s %9s %8s\n", "time_s", "chairs",
+         "occupancy", "queue", "served/s", "arrive/s", "turned", "retries");
+  printf("%9s %6s %12s %12s %9s %9s %9s %8s\n", "", "", "min/avg/max",
+         "min/avg/max", "", "", "away", "");
+
+  ShopStatsSnapshot last;
+  shop_stats_read(stats, &last);
+  uint64_t period_start = now_ns();
+  uint64_t report_ns = (uint64_t)report_ms * 1000000ull;
+  uint64_t next_sample = period_start;
+  Period period;
+  period_reset(&period);
+
+  for (;;) {
+    next_sample += (uint64_t)sample_us * 1000ull;
+    sleep_until_ns(next_sample);
+
+    ShopStatsSnapshot snap;
+    unsigned retries = shop_stats_read(stats, &snap);
+    period_add(&period, &snap, retries);
+
+    uint64_t now = now_ns();
+    if (now - period_start < report_ns && !snap.closed) {
+      continue;
+    }
+
+    double seconds = (double)(now - period_start) / 1e9;
+    printf("%9.3f %6lld %3lld/%4.1f/%3lld %3lld/%4.1f/%3lld %9.1f %9.1f "
+           "%9lld %8llu\n",
+           (double)(now - stats->start_ns) / 1e9, (long long)snap.chairs,
+           (long long)period.occupancy_min,
+           (double)period.occupancy_sum / (double)period.samples,
+           (long long)period.occupancy_max, (long long)period.queue_min,
+           (double)period.queue_sum / (double)period.samples,
+           (long long)period.queue_max,
+           (double)(snap.served - last.served) / seconds,
+           (double)(snap.arrivals - last.arrivals) / seconds,
+           (long long)snap.turned_away, (unsigned long long)period.retries);
+    fflush(stdout);
+
+    if (snap.closed) {
+      break;
+    }
+    last = snap;
+    period_start = now;
+    period_reset(&period);
+  }
+
+  munmap((void *)stats, sizeof(*stats));
+  return EXIT_SUCCESS;
+}
+
+static void period_reset(Period *period) {
+  period->samples = 0;
+  period->retries = 0;
+  period->occupancy_min = INT64_MAX;
+  period->occupancy_max = 0;
+  period->occupancy_sum = 0;
+  period->queue_min = INT64_MAX;
+  period->queue_max = 0;
+  period->queue_sum = 0;
+}
+
+static void period_add(Period *period, const ShopStatsSnapshot *snap,
+                       unsigned retries) {
+  int64_t occupancy = snap->waiting + snap->barber_busy;
+  period->samples++;
+  period->retries += retries;
+  period->occupancy_sum += occupancy;
+  if (occupancy < period->occupancy_min) {
+    period->occupancy_min = occupancy;
+  }
+  if (occupancy > period->occupancy_max) {
+    period->occupancy_max = occupancy;
+  }
+  period->queue_sum += snap->waiting;
+  if (snap->waiting < period->queue_min) {
+    period->queue_min = snap->waiting;
+  }
+  if (snap->waiting > period->queue_max) {
+    period->queue_max = snap->waiting;
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline_ns) {
+  struct timespec ts = {(time_t)(deadline_ns / 1000000000ull),
+                        (long)(deadline_ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static int parse_positive_int(const char *text, const char *label,
+                              int *value_out) {
+  char *end = NULL;
+  errno = 0;
+  long value = strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || value <= 0 ||
+      value > INT_MAX) {
+    fprintf(stderr, "Invalid %s: %s\n", label, text);
+    return -1;
+  }
+  *value_out = (int)value;
+  return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef SHOP_STATS_H
+#define SHOP_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SHOP_STATS_MAGIC 0x42524253u
+#define SHOP_STATS_VERSION 1
+
+/*
+ * Statistics block at offset 0 of the barbershop's shared segment.
+ *
+ * Writers already hold the shop mutex, so there is only ever one writer at a
+ * time; readers such as the monitor never take that mutex and instead retry
+ * until they see the same even sequence number before and after the copy.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t start_ns;
+  atomic_uint seq;
+  _Atomic int64_t chairs;
+  _Atomic int64_t waiting;
+  _Atomic int64_t barber_busy;
+  _Atomic int64_t arrivals;
+  _Atomic int64_t served;
+  _Atomic int64_t turned_away;
+  _Atomic int64_t closed;
+} ShopStats;
+
+typedef struct {
+  int64_t chairs;
+  int64_t waiting;
+  int64_t barber_busy;
+  int64_t arrivals;
+  int64_t served;
+  int64_t turned_away;
+  int64_t closed;
+} ShopStatsSnapshot;
+
+static inline void shop_stats_publish(ShopStats *stats,
+                                      const ShopStatsSnapshot *snap) {
+  unsigned seq = atomic_load_explicit(&stats->seq, memory_order_relaxed);
+  atomic_store_explicit(&stats->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  atomic_store_explicit(&stats->chairs, snap->chairs, memory_order_relaxed);
+  atomic_store_explicit(&stats->waiting, snap->waiting, memory_order_relaxed);
+  atomic_store_explicit(&stats->barber_busy, snap->barber_busy,
+                        memory_order_relaxed);
+  atomic_store_explicit(&stats->arrivals, snap->arrivals,
+                        memory_order_relaxed);
+  atomic_store_explicit(&stats->served, snap->served, memory_order_relaxed);
+  atomic_store_explicit(&stats->turned_away, snap->turned_away,
+                        memory_order_relaxed);
+  atomic_store_explicit(&stats->closed, snap->closed, memory_order_relaxed);
+
+  atomic_store_explicit(&stats->seq, seq + 2, memory_order_release);
+}
+
+/* Returns the number of retries needed to get a consistent copy. */
+static inline unsigned shop_stats_read(const ShopStats *stats,
+                                       ShopStatsSnapshot *out) {
+  unsigned retries = 0;
+  for (;;) {
+    unsigned before = atomic_load_explicit(&stats->seq, memory_order_acquire);
+    if ((before & 1u) == 0) {
+      out->chairs = atomic_load_explicit(&stats->chairs, memory_order_relaxed);
+      out->waiting = atomic_load_explicit(&stats->waiting, memory_order_relaxed);
+      out->barber_busy =
+          atomic_load_explicit(&stats->barber_busy, memory_order_relaxed);
+      out->arrivals =
+          atomic_load_explicit(&stats->arrivals, memory_order_relaxed);
+      out->served = atomic_load_explicit(&stats->served, memory_order_relaxed);
+      out->turned_away =
+          atomic_load_explicit(&stats->turned_away, memory_order_relaxed);
+      out->closed = atomic_load_explicit(&stats->closed, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&stats->seq, memory_order_relaxed) == before) {
+        return retries;
+      }
+    }
+    retries++;
+  }
+}
+
+#endif
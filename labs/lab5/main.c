@@ -1,18 +1,108 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
 #define BUF_SIZE 4096
+#define BLOCK_SIZE 4096
+#define INPUT_BLOCK_SIZE (1 << 20)
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define MAX_STAGES 16
+#define FINISH_MAX 16
+#define CHUNK_SIZE (1 << 16)
+#define MAX_WORKERS 64
+#define MAX_PROCESSES (MAX_STAGES * (MAX_WORKERS + 2))
+#define STAGE_NAME_SIZE 48
+#define PIPE_CAPACITY (1 << 20)
+#define SPLICE_CHUNK (1 << 20)
+#define DEFAULT_RING_CAPACITY (1 << 20)
+#define MAX_RING_CAPACITY (1ul << 30)
+#define HUGE_PAGE_SIZE (2ul << 20)
 #define DEFAULT_LINE_WIDTH 20
 #define DEFAULT_INPUT_FILE "input.txt"
 #define EOL_MARKER "<EOL>"
+#define SPLIT_CHECK_BYTES (4u << 20)
+#define CACHE_LINE 64
+
+typedef enum {
+  BUFFER_SEM,
+  BUFFER_SPSC,
+  BUFFER_PIPE,
+  BUFFER_MAGIC,
+} BufferKind;
+typedef enum { INPUT_READ, INPUT_MMAP } InputKind;
+typedef enum { BACKEND_PROCESS, BACKEND_THREAD } Backend;
+typedef enum {
+  KERNEL_AUTO,
+  KERNEL_SCALAR,
+  KERNEL_SSE2,
+  KERNEL_AVX2,
+} KernelKind;
+
+typedef size_t (*EolKernel)(const char *in, size_t len, char *out);
+typedef size_t (*SquashKernel)(bool *pending_star, const char *in, size_t len,
+                               char *out);
+
+typedef struct {
+  const char *name;
+  EolKernel expand_eol;
+  SquashKernel squash_stars;
+} KernelSet;
+
+/*
+ * Counters for one side of a channel. Only that side writes them, so plain
+ * relaxed adds are enough; the parent reads them for the report.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) atomic_ullong bytes;
+  atomic_ullong blocked_ns;
+  atomic_ullong mutex_ns;
+} SideStats;
+
+typedef struct {
+  SideStats push;
+  SideStats pop;
+} ChannelStats;
+
+/* Report row for one stage process, written only by that process. */
+typedef struct {
+  char name[STAGE_NAME_SIZE];
+  atomic_ullong bytes_in;
+  atomic_ullong bytes_out;
+  atomic_ullong blocked_ns;
+  atomic_ullong start_ns;
+  atomic_ullong end_ns;
+} StageStats;
+
+typedef struct {
+  size_t count;
+  StageStats stages[MAX_PROCESSES];
+} PipelineStats;
 
 typedef struct {
   char data[BUF_SIZE];
@@ -20,261 +110,2729 @@ typedef struct {
   size_t tail;
   size_t count;
   int done;
+  int reader_waiting;
+  int writer_waiting;
   sem_t mutex;
   sem_t items;
   sem_t spaces;
+  ChannelStats stats;
 } SharedBuffer;
 
+/*
+ * Lock-free single-producer/single-consumer ring. head and tail run freely
+ * and are reduced modulo the capacity on access; each index sits on its own
+ * cache line so the two sides never write to a shared line. The waiting
+ * flags double as futex words and are only slept on when the ring is empty
+ * (consumer) or full (producer). The plain ring keeps BUF_SIZE bytes of
+ * data right after this header; the magic ring keeps them in a double-mapped
+ * memfd (see map_magic_ring()).
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) atomic_size_t tail;
+  atomic_int done;
+  _Alignas(CACHE_LINE) atomic_size_t head;
+  _Alignas(CACHE_LINE) atomic_int consumer_waiting;
+  _Alignas(CACHE_LINE) atomic_int producer_waiting;
+  ChannelStats stats;
+  _Alignas(CACHE_LINE) char data[];
+} SpscRing;
+
+/*
+ * Handle on one link of the pipeline. cached_head is the producer's last
+ * view of the consumer's index and cached_tail the consumer's view of the
+ * producer's, so the fast path does not touch the peer's cache line; they
+ * sit on separate lines because the thread backend shares one Channel
+ * between both sides. Pipe channels carry their two fds instead, plus the
+ * producer's vmsplice() area (see pipe_reserve()).
+ */
+typedef struct {
+  BufferKind kind;
+  SharedBuffer *buffer;
+  SpscRing *ring;
+  char *data;
+  size_t capacity;
+  ChannelStats *stats;
+  size_t cached_head;
+  int fds[2];
+  size_t pipe_size;
+  bool consumer_splices;
+  char *gift;
+  size_t gift_size;
+  size_t gift_offset;
+  _Alignas(CACHE_LINE) size_t cached_tail;
+} Channel;
+
+typedef struct Stage Stage;
+
+/*
+ * Registry entry for one pipeline stage. process() must not write more than
+ * max_output(len) bytes; finish() flushes held state at end of stream and
+ * writes at most FINISH_MAX bytes (it may be NULL).
+ */
+typedef struct {
+  const char *name;
+  bool needs_arg;
+  size_t (*max_output)(const Stage *stage, size_t len);
+  size_t (*process)(Stage *stage, const char *in, size_t len, char *out);
+  size_t (*finish)(Stage *stage, char *out);
+} StageType;
+
+struct Stage {
+  const StageType *type;
+  int arg;
+  bool pending_star;
+  size_t column;
+};
+
+/* Consecutive fused stages that run in one process. */
+typedef struct {
+  Stage *stages;
+  size_t count;
+  Channel *out;
+  char *scratch[2];
+  size_t scratch_size;
+  char *output;
+  size_t output_used;
+  size_t output_size;
+  bool flushing;
+  bool closing;
+  uint64_t pending_since;
+  pthread_t flusher;
+  pthread_mutex_t output_lock;
+  pthread_cond_t output_wake;
+} StageGroup;
+
+/*
+ * One unit of work for the data-parallel squash stage. The worker leaves the
+ * leading run of '*' (lead_stars) unprocessed and squashes the rest (the
+ * body, which starts with a non-star) into out.
+ */
+typedef struct {
+  sem_t ready;
+  size_t in_len;
+  size_t out_len;
+  size_t lead_stars;
+  bool has_body;
+  bool trailing_star;
+  char in[CHUNK_SIZE];
+  char out[CHUNK_SIZE];
+} Chunk;
+
+/*
+ * Shared state of one data-parallel squash stage. Chunk seq lives in slot
+ * seq % slot_count from the moment the splitter fills it until the sequencer
+ * has emitted it.
+ */
+typedef struct {
+  sem_t mutex;
+  sem_t free_slots;
+  sem_t work;
+  int workers;
+  size_t next_work;
+  size_t chunk_count;
+  bool input_done;
+  size_t slot_count;
+  Chunk slots[];
+} ChunkPool;
+
+typedef enum { TASK_GROUP, TASK_SPLIT, TASK_WORKER, TASK_SEQUENCE } TaskKind;
+
+/* One process or thread of the running pipeline. */
+typedef struct {
+  TaskKind kind;
+  StageGroup *group;
+  ChunkPool *pool;
+  Channel *in;
+  Channel *out;
+  StageStats *stats;
+  int cpu;
+  pid_t pid;
+  pthread_t thread;
+} Task;
+
 static const char *g_input_path = DEFAULT_INPUT_FILE;
 static int g_line_width = DEFAULT_LINE_WIDTH;
 
-static void reader_process(SharedBuffer *out);
-static void transformer_process(SharedBuffer *in, SharedBuffer *out);
-static void printer_process(SharedBuffer *in);
+static BufferKind g_buffer_kind = BUFFER_SEM;
+static size_t g_ring_capacity = DEFAULT_RING_CAPACITY;
+static bool g_huge_pages = false;
+static InputKind g_input_kind = INPUT_READ;
+static KernelKind g_kernel_kind = KERNEL_AUTO;
+static KernelSet g_kernels;
+static int g_workers = 0;
+static int g_max_latency_ms = 0;
+static bool g_input_nonblock_set = false;
+
+static Backend g_backend = BACKEND_PROCESS;
+static bool g_pin_cpus = false;
+static Task g_tasks[MAX_PROCESSES];
+static size_t g_task_count;
+static size_t g_tasks_reaped;
+static atomic_int g_tasks_finished;
+
+static bool g_stats_enabled = false;
+static int g_sample_ms = 0;
+static PipelineStats *g_pipeline_stats;
+static _Thread_local StageStats *g_self;
+
+static Channel g_channels[MAX_STAGES];
+static size_t g_channel_count;
+static Stage g_stages[MAX_STAGES];
+static size_t g_stage_count;
+static StageGroup g_groups[MAX_STAGES];
+static size_t g_group_count;
+
+static int parse_stages(const char *spec);
+static int run_pipeline(void);
+static void add_task(TaskKind kind, const char *name, StageGroup *group,
+                     ChunkPool *pool, Channel *in, Channel *out);
+static void run_task(Task *task);
+static void *task_thread(void *arg);
+static void start_tasks(void);
+static void wait_tasks(void);
+static size_t tasks_running(void);
+static void pin_to_cpu(int index);
+static int compare_backends(int runs);
+static void run_group(StageGroup *group, Channel *in, Channel *out);
+static void group_init(StageGroup *group, Channel *out);
+static void group_push(StageGroup *group, size_t from, const char *in,
+                       size_t len);
+static void group_push_all(StageGroup *group, const char *in, size_t len);
+static void group_finish(StageGroup *group);
+static char *output_reserve(StageGroup *group, size_t len);
+static void flusher_start(StageGroup *group);
+static void *flusher_thread(void *arg);
+static void flusher_stop(StageGroup *group);
+
+static bool is_parallel_group(const StageGroup *group);
+static ChunkPool *chunk_pool_create(int workers);
+static void chunk_pool_destroy(ChunkPool *pool);
+static void split_chunks(ChunkPool *pool, Channel *in);
+static void squash_worker(ChunkPool *pool);
+static void sequence_chunks(ChunkPool *pool, Channel *out);
+
+static uint64_t now_ns(void);
+static uint64_t stats_clock(void);
+static void stats_add(atomic_ullong *counter, uint64_t value);
+static void stats_blocked(SideStats *side, uint64_t since);
+static void stats_held(SideStats *side, uint64_t since);
+static void stage_count_in(size_t len);
+static void stage_count_out(size_t len);
+static StageStats *stats_register(const char *name);
+static void stage_enter(StageStats *stats);
+static void stage_exit(void);
+static void group_name(const StageGroup *group, char *out, size_t size);
+static void print_stats_report(Channel *channels, size_t channel_count);
+static void sample_until_done(int interval_ms);
+
+static pid_t fork_stage(Channel *in, Channel *out);
+static char *pipe_reserve(Channel *channel, size_t len);
+static void pipe_commit(Channel *channel, size_t len);
+static bool pipe_can_gift(const Channel *channel, size_t len);
+static size_t pipe_push_n(Channel *channel, const char *src, size_t len);
+static size_t pipe_pop_n(Channel *channel, char *dst, size_t max);
+static bool is_passthrough_group(const StageGroup *group);
+static bool splice_all(int in_fd, Channel *in, int out_fd, Channel *out);
+static bool run_passthrough(StageGroup *group, Channel *in, Channel *out);
+
+static int open_input(bool *streaming);
+static void close_input(int fd);
+static void read_input(StageGroup *group);
+static bool read_mapped(int fd, StageGroup *group);
+static size_t read_block(int fd, char *dst, size_t max);
+static size_t read_available(int fd, char *dst, size_t max);
+static void write_all(int fd, const char *src, size_t len);
+
+static size_t cat_max_output(const Stage *stage, size_t len);
+static size_t cat_process(Stage *stage, const char *in, size_t len,
+                          char *out);
+static size_t eol_max_output(const Stage *stage, size_t len);
+static size_t eol_process(Stage *stage, const char *in, size_t len,
+                          char *out);
+static size_t squash_max_output(const Stage *stage, size_t len);
+static size_t squash_process(Stage *stage, const char *in, size_t len,
+                             char *out);
+static size_t squash_finish(Stage *stage, char *out);
+static size_t wrap_max_output(const Stage *stage, size_t len);
+static size_t wrap_process(Stage *stage, const char *in, size_t len,
+                           char *out);
+static size_t wrap_finish(Stage *stage, char *out);
+
+static Channel channel_create(BufferKind kind);
+static void channel_release(Channel *channel);
+static void channel_destroy(Channel *channel);
+static size_t channel_push_n(Channel *channel, const char *src, size_t len);
+static size_t channel_pop_n(Channel *channel, char *dst, size_t max);
+static void channel_write_all(Channel *channel, const char *src, size_t len);
+static void channel_signal_done(Channel *channel);
 
 static void buffer_init(SharedBuffer *buffer);
 static void buffer_destroy(SharedBuffer *buffer);
-static void buffer_push(SharedBuffer *buffer, char ch);
-static bool buffer_pop(SharedBuffer *buffer, char *out);
+static size_t buffer_push_n(SharedBuffer *buffer, const char *src, size_t len);
+static size_t buffer_pop_n(SharedBuffer *buffer, char *dst, size_t max);
 static void buffer_signal_done(SharedBuffer *buffer);
 
+static size_t ring_wait_space(Channel *channel, size_t min);
+static size_t ring_wait_data(Channel *channel);
+static void ring_publish(Channel *channel, size_t n);
+static void ring_release(Channel *channel, size_t n);
+static size_t ring_push_n(Channel *channel, const char *src, size_t len);
+static size_t ring_pop_n(Channel *channel, char *dst, size_t max);
+static char *magic_reserve(Channel *channel, size_t len);
+static void magic_commit(Channel *channel, size_t len);
+static size_t magic_peek(Channel *channel, const char **window);
+static void magic_consume(Channel *channel, size_t len);
+static char *map_magic_ring(size_t capacity);
+static void ring_signal_done(SpscRing *ring);
+static void futex_wait(atomic_int *word, int expected);
+static void futex_wake(atomic_int *word);
+
+static size_t expand_eol(const char *in, size_t len, char *out);
+static size_t squash_stars(bool *pending_star, const char *in, size_t len,
+                           char *out);
+#ifdef HAVE_X86_KERNELS
+static size_t expand_eol_sse2(const char *in, size_t len, char *out);
+static size_t squash_stars_sse2(bool *pending_star, const char *in,
+                                size_t len, char *out);
+static size_t expand_eol_avx2(const char *in, size_t len, char *out);
+static size_t squash_stars_avx2(bool *pending_star, const char *in,
+                                size_t len, char *out);
+#endif
+static KernelSet select_kernels(KernelKind kind);
+static int bench_kernels(int megabytes);
+static double seconds_since(const struct timespec *start);
+
 static void safe_sem_wait(sem_t *sem);
 static void safe_sem_post(sem_t *sem);
 static void wait_for_child(pid_t pid);
+static void usage(const char *prog);
 static int parse_positive_int(const char *text, const char *label,
                               int *value_out);
+static int parse_size(const char *text, const char *label, size_t *value_out);
 
 int main(int argc, char *argv[]) {
-  if (argc > 3) {
-    fprintf(stderr, "Usage: %s [input_file] [line_width]\n", argv[0]);
+  static const struct option long_options[] = {
+      {"buffer", required_argument, NULL, 'b'},
+      {"capacity", required_argument, NULL, 'c'},
+      {"huge-pages", no_argument, NULL, 'H'},
+      {"kernel", required_argument, NULL, 'k'},
+      {"input", required_argument, NULL, 'i'},
+      {"stages", required_argument, NULL, 's'},
+      {"workers", required_argument, NULL, 'w'},
+      {"max-latency", required_argument, NULL, 'l'},
+      {"stats", optional_argument, NULL, 'T'},
+      {"backend", required_argument, NULL, 'E'},
+      {"pin", no_argument, NULL, 'N'},
+      {"compare-backends", optional_argument, NULL, 'C'},
+      {"bench-kernels", optional_argument, NULL, 'B'},
+      {NULL, 0, NULL, 0},
+  };
+
+  const char *stage_spec = NULL;
+  int bench_megabytes = 0;
+  int compare_runs = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:c:i:k:l:s:w:", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "sem") == 0) {
+        g_buffer_kind = BUFFER_SEM;
+      } else if (strcmp(optarg, "spsc") == 0) {
+        g_buffer_kind = BUFFER_SPSC;
+      } else if (strcmp(optarg, "pipe") == 0) {
+        g_buffer_kind = BUFFER_PIPE;
+      } else if (strcmp(optarg, "magic") == 0) {
+        g_buffer_kind = BUFFER_MAGIC;
+      } else {
+        fprintf(stderr, "Invalid buffer kind: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'c':
+      if (parse_size(optarg, "capacity", &g_ring_capacity) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'H':
+      g_huge_pages = true;
+      break;
+    case 'i':
+      if (strcmp(optarg, "read") == 0) {
+        g_input_kind = INPUT_READ;
+      } else if (strcmp(optarg, "mmap") == 0) {
+        g_input_kind = INPUT_MMAP;
+      } else {
+        fprintf(stderr, "Invalid input kind: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'k':
+      if (strcmp(optarg, "auto") == 0) {
+        g_kernel_kind = KERNEL_AUTO;
+      } else if (strcmp(optarg, "scalar") == 0) {
+        g_kernel_kind = KERNEL_SCALAR;
+      } else if (strcmp(optarg, "sse2") == 0) {
+        g_kernel_kind = KERNEL_SSE2;
+      } else if (strcmp(optarg, "avx2") == 0) {
+        g_kernel_kind = KERNEL_AVX2;
+      } else {
+        fprintf(stderr, "Invalid kernel: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'l':
+      if (parse_positive_int(optarg, "max latency", &g_max_latency_ms) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      stage_spec = optarg;
+      break;
+    case 'w':
+      if (parse_positive_int(optarg, "worker count", &g_workers) != 0) {
+        return EXIT_FAILURE;
+      }
+      if (g_workers > MAX_WORKERS) {
+        fprintf(stderr, "At most %d workers\n", MAX_WORKERS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      g_stats_enabled = true;
+      if (optarg &&
+          parse_positive_int(optarg, "sample interval", &g_sample_ms) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'E':
+      if (strcmp(optarg, "process") == 0) {
+        g_backend = BACKEND_PROCESS;
+      } else if (strcmp(optarg, "thread") == 0) {
+        g_backend = BACKEND_THREAD;
+      } else {
+        fprintf(stderr, "Invalid backend: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'N':
+      g_pin_cpus = true;
+      break;
+    case 'C':
+      compare_runs = 3;
+      if (optarg &&
+          parse_positive_int(optarg, "run count", &compare_runs) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'B':
+      bench_megabytes = 64;
+      if (optarg &&
+          parse_positive_int(optarg, "benchmark size", &bench_megabytes) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (bench_megabytes > 0) {
+    return bench_kernels(bench_megabytes);
+  }
+
+  g_kernels = select_kernels(g_kernel_kind);
+
+  size_t page = g_huge_pages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  if (g_ring_capacity % page != 0 || g_ring_capacity > MAX_RING_CAPACITY) {
+    fprintf(stderr, "Ring capacity must be a multiple of %zu up to %lu\n",
+            page, MAX_RING_CAPACITY);
+    return EXIT_FAILURE;
+  }
+
+  int positional = argc - optind;
+  if (positional > 2) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  if (argc >= 2) {
-    g_input_path = argv[1];
+  if (positional >= 1) {
+    g_input_path = argv[optind];
   }
 
-  if (argc == 3) {
-    if (parse_positive_int(argv[2], "line_width", &g_line_width) != 0) {
+  if (positional == 2) {
+    if (parse_positive_int(argv[optind + 1], "line_width", &g_line_width) !=
+        0) {
       return EXIT_FAILURE;
     }
   }
 
-  SharedBuffer *shm1 = mmap(NULL, sizeof(*shm1), PROT_READ | PROT_WRITE,
-                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-  if (shm1 == MAP_FAILED) {
-    perror("mmap shm1");
+  char default_spec[64];
+  if (!stage_spec) {
+    snprintf(default_spec, sizeof(default_spec), "eol,squash,wrap:%d",
+             g_line_width);
+    stage_spec = default_spec;
+  }
+  if (parse_stages(stage_spec) != 0) {
     return EXIT_FAILURE;
   }
 
-  SharedBuffer *shm2 = mmap(NULL, sizeof(*shm2), PROT_READ | PROT_WRITE,
-                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-  if (shm2 == MAP_FAILED) {
-    perror("mmap shm2");
-    return EXIT_FAILURE;
+  if (compare_runs > 0) {
+    if (strcmp(g_input_path, "-") == 0) {
+      fprintf(stderr, "--compare-backends needs an input file\n");
+      return EXIT_FAILURE;
+    }
+    return compare_backends(compare_runs);
   }
+  return run_pipeline();
+}
 
-  buffer_init(shm1);
-  buffer_init(shm2);
+/*
+ * Builds and runs the pipeline once with g_backend: one task per stage group
+ * (or splitter, workers and sequencer for a parallel group), then waits for
+ * all of them and prints the stats report.
+ */
+static int run_pipeline(void) {
+  if (g_stats_enabled) {
+    g_pipeline_stats = mmap(NULL, sizeof(*g_pipeline_stats),
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                            -1, 0);
+    if (g_pipeline_stats == MAP_FAILED) {
+      perror("mmap stats");
+      return EXIT_FAILURE;
+    }
+  }
 
-  pid_t reader_pid = fork();
-  if (reader_pid < 0) {
-    perror("fork reader");
-    return EXIT_FAILURE;
+  g_channel_count = g_group_count - 1;
+  for (size_t i = 0; i < g_channel_count; i++) {
+    g_channels[i] = channel_create(g_buffer_kind);
+    g_channels[i].consumer_splices = is_passthrough_group(&g_groups[i + 1]);
   }
-  if (reader_pid == 0) {
-    reader_process(shm1);
-    exit(EXIT_SUCCESS);
+
+  ChunkPool *pools[MAX_STAGES] = {NULL};
+  g_task_count = 0;
+  for (size_t i = 0; i < g_group_count; i++) {
+    Channel *in = i == 0 ? NULL : &g_channels[i - 1];
+    Channel *out = i + 1 == g_group_count ? NULL : &g_channels[i];
+    if (is_parallel_group(&g_groups[i])) {
+      pools[i] = chunk_pool_create(g_workers);
+      add_task(TASK_SPLIT, "split", NULL, pools[i], in, NULL);
+      for (int w = 0; w < g_workers; w++) {
+        char name[STAGE_NAME_SIZE];
+        snprintf(name, sizeof(name), "squash#%d", w);
+        add_task(TASK_WORKER, name, NULL, pools[i], NULL, NULL);
+      }
+      add_task(TASK_SEQUENCE, "sequence", NULL, pools[i], NULL, out);
+      continue;
+    }
+
+    char name[STAGE_NAME_SIZE];
+    group_name(&g_groups[i], name, sizeof(name));
+    add_task(TASK_GROUP, name, &g_groups[i], NULL, in, out);
   }
 
-  pid_t transformer_pid = fork();
-  if (transformer_pid < 0) {
-    perror("fork transformer");
-    return EXIT_FAILURE;
+  start_tasks();
+  wait_tasks();
+
+  if (g_stats_enabled) {
+    print_stats_report(g_channels, g_channel_count);
+    munmap(g_pipeline_stats, sizeof(*g_pipeline_stats));
   }
-  if (transformer_pid == 0) {
-    transformer_process(shm1, shm2);
-    exit(EXIT_SUCCESS);
+  for (size_t i = 0; i < g_group_count; i++) {
+    if (pools[i]) {
+      chunk_pool_destroy(pools[i]);
+    }
+  }
+  for (size_t i = 0; i < g_channel_count; i++) {
+    channel_destroy(&g_channels[i]);
+  }
+  return EXIT_SUCCESS;
+}
+
+static void add_task(TaskKind kind, const char *name, StageGroup *group,
+                     ChunkPool *pool, Channel *in, Channel *out) {
+  Task *task = &g_tasks[g_task_count];
+  task->kind = kind;
+  task->group = group;
+  task->pool = pool;
+  task->in = in;
+  task->out = out;
+  task->stats = stats_register(name);
+  task->cpu = (int)g_task_count;
+  g_task_count++;
+}
+
+static void run_task(Task *task) {
+  stage_enter(task->stats);
+  if (g_pin_cpus) {
+    pin_to_cpu(task->cpu);
   }
 
-  pid_t printer_pid = fork();
-  if (printer_pid < 0) {
-    perror("fork printer");
-    return EXIT_FAILURE;
+  switch (task->kind) {
+  case TASK_GROUP:
+    run_group(task->group, task->in, task->out);
+    break;
+  case TASK_SPLIT:
+    split_chunks(task->pool, task->in);
+    break;
+  case TASK_WORKER:
+    squash_worker(task->pool);
+    break;
+  case TASK_SEQUENCE:
+    sequence_chunks(task->pool, task->out);
+    break;
   }
-  if (printer_pid == 0) {
-    printer_process(shm2);
-    exit(EXIT_SUCCESS);
+
+  stage_exit();
+  atomic_fetch_add(&g_tasks_finished, 1);
+}
+
+static void *task_thread(void *arg) {
+  run_task(arg);
+  return NULL;
+}
+
+static void start_tasks(void) {
+  atomic_store(&g_tasks_finished, 0);
+  g_tasks_reaped = 0;
+
+  for (size_t i = 0; i < g_task_count; i++) {
+    Task *task = &g_tasks[i];
+    if (g_backend == BACKEND_THREAD) {
+      int err = pthread_create(&task->thread, NULL, task_thread, task);
+      if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    task->pid = fork_stage(task->in, task->out);
+    if (task->pid < 0) {
+      perror("fork stage");
+      exit(EXIT_FAILURE);
+    }
+    if (task->pid == 0) {
+      run_task(task);
+      exit(EXIT_SUCCESS);
+    }
   }
 
-  wait_for_child(reader_pid);
-  wait_for_child(transformer_pid);
-  wait_for_child(printer_pid);
+  if (g_backend == BACKEND_PROCESS) {
+    for (size_t i = 0; i < g_channel_count; i++) {
+      channel_release(&g_channels[i]);
+    }
+  }
+}
 
-  buffer_destroy(shm1);
-  buffer_destroy(shm2);
-  munmap(shm1, sizeof(*shm1));
-  munmap(shm2, sizeof(*shm2));
+static void wait_tasks(void) {
+  if (g_sample_ms > 0) {
+    sample_until_done(g_sample_ms);
+  }
+  for (size_t i = 0; i < g_task_count; i++) {
+    if (g_backend == BACKEND_THREAD) {
+      pthread_join(g_tasks[i].thread, NULL);
+    } else if (g_sample_ms == 0) {
+      wait_for_child(g_tasks[i].pid);
+    }
+  }
+}
 
-  return EXIT_SUCCESS;
+/* Reaps finished stage processes without blocking; returns how many run. */
+static size_t tasks_running(void) {
+  if (g_backend == BACKEND_THREAD) {
+    return g_task_count - (size_t)atomic_load(&g_tasks_finished);
+  }
+  while (g_tasks_reaped < g_task_count && waitpid(-1, NULL, WNOHANG) > 0) {
+    g_tasks_reaped++;
+  }
+  return g_task_count - g_tasks_reaped;
 }
 
-static void reader_process(SharedBuffer *out) {
-  FILE *fp = fopen(g_input_path, "r");
-  if (!fp) {
-    perror("reader fopen");
-    buffer_signal_done(out);
-    exit(EXIT_FAILURE);
+static void pin_to_cpu(int index) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET((int)(index % (cpus > 0 ? cpus : 1)), &set);
+  /* pid 0 is the calling thread, so this works for both backends. */
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    perror("sched_setaffinity");
   }
+}
 
-  int ch;
-  const char *marker = EOL_MARKER;
-  size_t marker_len = strlen(marker);
+/*
+ * Runs the whole pipeline `runs` times per backend, alternating between
+ * them, with stdout sent to /dev/null. Each run is a fresh child so stage
+ * state never leaks from one run into the next. Prints the best time each.
+ */
+static int compare_backends(int runs) {
+  static const char *names[] = {"process", "thread"};
+  double best[2] = {0.0, 0.0};
 
-  while ((ch = fgetc(fp)) != EOF) {
-    if (ch == '\n') {
-      for (size_t i = 0; i < marker_len; i++) {
-        buffer_push(out, marker[i]);
+  for (int run = 0; run < runs; run++) {
+    for (int b = 0; b < 2; b++) {
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+      }
+      if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+          perror("redirect stdout");
+          exit(EXIT_FAILURE);
+        }
+        close(null_fd);
+        g_backend = b == 0 ? BACKEND_PROCESS : BACKEND_THREAD;
+        exit(run_pipeline());
+      }
+
+      int status;
+      while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+          perror("waitpid");
+          return EXIT_FAILURE;
+        }
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s run failed\n", names[b]);
+        return EXIT_FAILURE;
+      }
+      double seconds = seconds_since(&start);
+      if (run == 0 || seconds < best[b]) {
+        best[b] = seconds;
       }
-    } else {
-      buffer_push(out, (char)ch);
     }
   }
 
-  fclose(fp);
-  buffer_signal_done(out);
+  struct stat st;
+  double megabytes =
+      stat(g_input_path, &st) == 0 ? (double)st.st_size / 1e6 : 0.0;
+  fprintf(stderr, "%-8s %12s %10s\n", "backend", "best s", "MB/s");
+  for (int b = 0; b < 2; b++) {
+    fprintf(stderr, "%-8s %12.3f %10.1f\n", names[b], best[b],
+            megabytes / best[b]);
+  }
+  int faster = best[1] < best[0] ? 1 : 0;
+  fprintf(stderr, "faster: %s (%.2fx, best of %d)\n", names[faster],
+          best[1 - faster] / best[faster], runs);
+  return EXIT_SUCCESS;
+}
+
+static const StageType g_stage_types[] = {
+    {"cat", false, cat_max_output, cat_process, NULL},
+    {"eol", false, eol_max_output, eol_process, NULL},
+    {"squash", false, squash_max_output, squash_process, squash_finish},
+    {"wrap", true, wrap_max_output, wrap_process, wrap_finish},
+};
+
+/*
+ * Parses a spec such as "eol+squash,wrap:20". Stages joined by '+' are fused
+ * into one group that runs in a single process; ',' starts a new process.
+ */
+static int parse_stages(const char *spec) {
+  g_stage_count = 0;
+  g_group_count = 0;
+  const char *p = spec;
+  char separator = ',';
+
+  for (;;) {
+    size_t len = strcspn(p, ",+");
+    const char *colon = memchr(p, ':', len);
+    size_t name_len = colon ? (size_t)(colon - p) : len;
+
+    const StageType *type = NULL;
+    for (size_t i = 0; i < sizeof(g_stage_types) / sizeof(g_stage_types[0]);
+         i++) {
+      if (strlen(g_stage_types[i].name) == name_len &&
+          strncmp(g_stage_types[i].name, p, name_len) == 0) {
+        type = &g_stage_types[i];
+      }
+    }
+    if (!type) {
+      fprintf(stderr, "Unknown stage: %.*s\n", (int)len, p);
+      return -1;
+    }
+    if (g_stage_count == MAX_STAGES) {
+      fprintf(stderr, "Too many stages (max %d)\n", MAX_STAGES);
+      return -1;
+    }
+
+    Stage *stage = &g_stages[g_stage_count];
+    memset(stage, 0, sizeof(*stage));
+    stage->type = type;
+    if (type->needs_arg) {
+      char arg[32];
+      size_t arg_len = colon ? len - name_len - 1 : 0;
+      if (arg_len == 0 || arg_len >= sizeof(arg)) {
+        fprintf(stderr, "Stage %s needs an argument, e.g. %s:20\n",
+                type->name, type->name);
+        return -1;
+      }
+      memcpy(arg, colon + 1, arg_len);
+      arg[arg_len] = '\0';
+      if (parse_positive_int(arg, type->name, &stage->arg) != 0) {
+        return -1;
+      }
+    } else if (colon) {
+      fprintf(stderr, "Stage %s takes no argument\n", type->name);
+      return -1;
+    }
+
+    if (separator == ',') {
+      g_groups[g_group_count].stages = stage;
+      g_groups[g_group_count].count = 0;
+      g_group_count++;
+    }
+    g_groups[g_group_count - 1].count++;
+    g_stage_count++;
+
+    separator = p[len];
+    if (separator == '\0') {
+      return 0;
+    }
+    p += len + 1;
+  }
 }
 
-static void transformer_process(SharedBuffer *in, SharedBuffer *out) {
-  char prev = '\0';
-  char ch;
+/*
+ * Runs one process worth of the pipeline. The first group reads the input
+ * file, the last one owns stdout; everything in between pops from in and
+ * pushes to out.
+ */
+static void run_group(StageGroup *group, Channel *in, Channel *out) {
+  if (run_passthrough(group, in, out)) {
+    return;
+  }
+
+  group_init(group, out);
 
-  while (buffer_pop(in, &ch)) {
-    if (prev == '*') {
-      if (ch == '*') {
-        buffer_push(out, '#');
-        prev = '\0';
-        continue;
+  if (!in) {
+    read_input(group);
+  } else if (in->kind == BUFFER_MAGIC) {
+    const char *window;
+    size_t len;
+    while ((len = magic_peek(in, &window)) > 0) {
+      stage_count_in(len);
+      if (!out && is_passthrough_group(group)) {
+        stage_count_out(len);
+        write_all(STDOUT_FILENO, window, len);
+      } else {
+        group_push_all(group, window, len);
       }
-      buffer_push(out, prev);
-      prev = ch;
-      continue;
+      magic_consume(in, len);
     }
+  } else {
+    char *block = malloc(BLOCK_SIZE);
+    if (!block) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    size_t len;
+    while ((len = channel_pop_n(in, block, BLOCK_SIZE)) > 0) {
+      stage_count_in(len);
+      group_push_all(group, block, len);
+    }
+    free(block);
+  }
 
-    if (ch == '*') {
-      prev = ch;
-    } else {
-      buffer_push(out, ch);
+  group_finish(group);
+}
+
+/*
+ * Sizes the scratch buffers from each stage's worst-case growth for one
+ * BLOCK_SIZE piece; fused stages ping-pong between the two.
+ */
+static void group_init(StageGroup *group, Channel *out) {
+  size_t bound = BLOCK_SIZE;
+  size_t largest = BLOCK_SIZE;
+  for (size_t i = 0; i < group->count; i++) {
+    Stage *stage = &group->stages[i];
+    bound = stage->type->max_output(stage, bound);
+    if (bound > largest) {
+      largest = bound;
+    }
+  }
+
+  group->out = out;
+  group->scratch_size = largest;
+  group->scratch[0] = malloc(largest);
+  group->scratch[1] = malloc(largest);
+  group->output_size = largest > OUTPUT_BUFFER_SIZE ? largest
+                                                    : OUTPUT_BUFFER_SIZE;
+  group->output = out ? NULL : malloc(group->output_size);
+  group->output_used = 0;
+  if (!group->scratch[0] || !group->scratch[1] || (!out && !group->output)) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  group->flushing = false;
+  if (!out && g_max_latency_ms > 0) {
+    flusher_start(group);
+  }
+}
+
+/*
+ * Feeds len (at most BLOCK_SIZE) bytes through stages from..count-1. The last
+ * stage of the last group formats straight into the stdout buffer; otherwise
+ * the result goes to the next process (or, for bytes emitted by the final
+ * stage's finish(), is appended to stdout as is).
+ */
+static void group_push(StageGroup *group, size_t from, const char *in,
+                       size_t len) {
+  for (size_t i = from; i < group->count; i++) {
+    Stage *stage = &group->stages[i];
+    if (i + 1 == group->count && !group->out) {
+      char *dst = output_reserve(group, stage->type->max_output(stage, len));
+      size_t produced = stage->type->process(stage, in, len, dst);
+      group->output_used += produced;
+      stage_count_out(produced);
+      return;
     }
+    if (i + 1 == group->count && group->out->kind == BUFFER_MAGIC &&
+        stage->type->max_output(stage, len) <= group->out->capacity) {
+      char *dst =
+          magic_reserve(group->out, stage->type->max_output(stage, len));
+      size_t produced = stage->type->process(stage, in, len, dst);
+      stage_count_out(produced);
+      magic_commit(group->out, produced);
+      return;
+    }
+    if (i + 1 == group->count &&
+        pipe_can_gift(group->out, stage->type->max_output(stage, len))) {
+      char *dst = pipe_reserve(group->out, stage->type->max_output(stage, len));
+      size_t produced = stage->type->process(stage, in, len, dst);
+      stage_count_out(produced);
+      pipe_commit(group->out, produced);
+      return;
+    }
+    char *dst = group->scratch[i % 2];
+    len = stage->type->process(stage, in, len, dst);
+    in = dst;
   }
 
-  if (prev == '*') {
-    buffer_push(out, prev);
+  stage_count_out(len);
+  if (group->out) {
+    channel_write_all(group->out, in, len);
+  } else {
+    memcpy(output_reserve(group, len), in, len);
+    group->output_used += len;
   }
+}
 
-  buffer_signal_done(out);
+/*
+ * Splits a large input block into the BLOCK_SIZE pieces group_push takes.
+ * With a flusher running, the stdout buffer is only touched under
+ * output_lock.
+ */
+static void group_push_all(StageGroup *group, const char *in, size_t len) {
+  if (group->flushing) {
+    pthread_mutex_lock(&group->output_lock);
+  }
+  while (len > 0) {
+    size_t n = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+    group_push(group, 0, in, n);
+    in += n;
+    len -= n;
+  }
+  if (group->flushing) {
+    pthread_mutex_unlock(&group->output_lock);
+  }
 }
 
-static void printer_process(SharedBuffer *in) {
-  int count = 0;
-  char ch;
+/*
+ * Flushes held state (a pending '*', an unfinished line) stage by stage; what
+ * a stage emits on finish still passes through the stages after it.
+ */
+static void group_finish(StageGroup *group) {
+  flusher_stop(group);
 
-  while (buffer_pop(in, &ch)) {
-    putchar(ch);
-    count++;
-    if (count == g_line_width) {
-      putchar('\n');
-      count = 0;
+  char tail[FINISH_MAX];
+  for (size_t i = 0; i < group->count; i++) {
+    Stage *stage = &group->stages[i];
+    if (stage->type->finish) {
+      size_t len = stage->type->finish(stage, tail);
+      if (len > 0) {
+        group_push(group, i + 1, tail, len);
+      }
     }
   }
 
-  if (count > 0) {
-    putchar('\n');
+  if (group->out) {
+    channel_signal_done(group->out);
+  } else {
+    write_all(STDOUT_FILENO, group->output, group->output_used);
+  }
+
+  free(group->scratch[0]);
+  free(group->scratch[1]);
+  free(group->output);
+}
+
+static char *output_reserve(StageGroup *group, size_t len) {
+  if (group->output_size - group->output_used < len) {
+    write_all(STDOUT_FILENO, group->output, group->output_used);
+    group->output_used = 0;
+  }
+  if (group->flushing && group->output_used == 0) {
+    group->pending_since = now_ns();
+    pthread_cond_signal(&group->output_wake);
   }
+  return group->output + group->output_used;
 }
 
-static void buffer_init(SharedBuffer *buffer) {
-  buffer->head = 0;
-  buffer->tail = 0;
-  buffer->count = 0;
-  buffer->done = 0;
+/*
+ * With --max-latency the final group runs a flusher thread next to the
+ * stage loop. It writes out whatever the stdout buffer holds, partial line
+ * included, g_max_latency_ms after the buffer last went from empty to
+ * pending (pending_since), however steadily output keeps arriving. A batch
+ * run pays at most one extra write() per period.
+ */
+static void flusher_start(StageGroup *group) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&group->output_lock, NULL);
+  pthread_cond_init(&group->output_wake, &attr);
+  pthread_condattr_destroy(&attr);
 
-  if (sem_init(&buffer->mutex, 1, 1) == -1 ||
-      sem_init(&buffer->items, 1, 0) == -1 ||
-      sem_init(&buffer->spaces, 1, BUF_SIZE) == -1) {
-    perror("sem_init");
+  group->closing = false;
+  group->pending_since = 0;
+  int err = pthread_create(&group->flusher, NULL, flusher_thread, group);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create flusher: %s\n", strerror(err));
     exit(EXIT_FAILURE);
   }
+  group->flushing = true;
 }
 
-static void buffer_destroy(SharedBuffer *buffer) {
-  sem_destroy(&buffer->mutex);
-  sem_destroy(&buffer->items);
-  sem_destroy(&buffer->spaces);
+static void *flusher_thread(void *arg) {
+  StageGroup *group = arg;
+  uint64_t latency = (uint64_t)g_max_latency_ms * 1000000ull;
+
+  pthread_mutex_lock(&group->output_lock);
+  while (!group->closing) {
+    if (group->output_used == 0) {
+      pthread_cond_wait(&group->output_wake, &group->output_lock);
+      continue;
+    }
+    uint64_t due = group->pending_since + latency;
+    if (now_ns() >= due) {
+      write_all(STDOUT_FILENO, group->output, group->output_used);
+      group->output_used = 0;
+      continue;
+    }
+    struct timespec deadline = {(time_t)(due / 1000000000ull),
+                                (long)(due % 1000000000ull)};
+    pthread_cond_timedwait(&group->output_wake, &group->output_lock,
+                           &deadline);
+  }
+  pthread_mutex_unlock(&group->output_lock);
+  return NULL;
 }
 
-static void buffer_push(SharedBuffer *buffer, char ch) {
-  safe_sem_wait(&buffer->spaces);
-  safe_sem_wait(&buffer->mutex);
+static void flusher_stop(StageGroup *group) {
+  if (!group->flushing) {
+    return;
+  }
+  pthread_mutex_lock(&group->output_lock);
+  group->closing = true;
+  pthread_cond_signal(&group->output_wake);
+  pthread_mutex_unlock(&group->output_lock);
+  pthread_join(group->flusher, NULL);
+  pthread_cond_destroy(&group->output_wake);
+  pthread_mutex_destroy(&group->output_lock);
+  group->flushing = false;
+}
+
+static bool is_parallel_group(const StageGroup *group) {
+  return g_workers > 0 && group->count == 1 &&
+         group->stages[0].type->process == squash_process;
+}
 
-  buffer->data[buffer->tail] = ch;
-  buffer->tail = (buffer->tail + 1) % BUF_SIZE;
-  buffer->count++;
+static ChunkPool *chunk_pool_create(int workers) {
+  size_t slot_count = 2 * (size_t)workers + 2;
+  size_t size = sizeof(ChunkPool) + slot_count * sizeof(Chunk);
+  ChunkPool *pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    perror("mmap chunk pool");
+    exit(EXIT_FAILURE);
+  }
 
-  safe_sem_post(&buffer->mutex);
-  safe_sem_post(&buffer->items);
+  pool->workers = workers;
+  pool->slot_count = slot_count;
+  pool->next_work = 0;
+  pool->chunk_count = 0;
+  pool->input_done = false;
+  int pshared = g_backend == BACKEND_PROCESS;
+  if (sem_init(&pool->mutex, pshared, 1) == -1 ||
+      sem_init(&pool->free_slots, pshared, (unsigned)slot_count) == -1 ||
+      sem_init(&pool->work, pshared, 0) == -1) {
+    perror("sem_init");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < slot_count; i++) {
+    if (sem_init(&pool->slots[i].ready, pshared, 0) == -1) {
+      perror("sem_init");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
 }
 
-static bool buffer_pop(SharedBuffer *buffer, char *out) {
-  safe_sem_wait(&buffer->items);
-  safe_sem_wait(&buffer->mutex);
+static void chunk_pool_destroy(ChunkPool *pool) {
+  for (size_t i = 0; i < pool->slot_count; i++) {
+    sem_destroy(&pool->slots[i].ready);
+  }
+  sem_destroy(&pool->mutex);
+  sem_destroy(&pool->free_slots);
+  sem_destroy(&pool->work);
+  munmap(pool, sizeof(ChunkPool) + pool->slot_count * sizeof(Chunk));
+}
 
-  if (buffer->count == 0 && buffer->done) {
-    safe_sem_post(&buffer->mutex);
-    return false;
+/*
+ * Cuts the stream into CHUNK_SIZE pieces numbered 0, 1, 2, ... and queues
+ * them for the workers. After the last chunk it parks an empty chunk in the
+ * next slot to tell the sequencer the stream has ended.
+ */
+static void split_chunks(ChunkPool *pool, Channel *in) {
+  int fd = -1;
+  bool streaming = false;
+  if (!in) {
+    fd = open_input(&streaming);
   }
 
-  *out = buffer->data[buffer->head];
-  buffer->head = (buffer->head + 1) % BUF_SIZE;
-  buffer->count--;
+  size_t seq = 0;
+  for (;; seq++) {
+    Chunk *chunk = &pool->slots[seq % pool->slot_count];
+    uint64_t wait_start = stats_clock();
+    safe_sem_wait(&pool->free_slots);
+    stats_blocked(NULL, wait_start);
 
-  safe_sem_post(&buffer->mutex);
-  safe_sem_post(&buffer->spaces);
-  return true;
-}
+    size_t len = 0;
+    if (in) {
+      size_t n;
+      while (len < CHUNK_SIZE &&
+             (n = channel_pop_n(in, chunk->in + len, CHUNK_SIZE - len)) > 0) {
+        len += n;
+        if (g_max_latency_ms > 0) {
+          break;
+        }
+      }
+    } else if (streaming) {
+      len = read_available(fd, chunk->in, CHUNK_SIZE);
+    } else if (fd != -1) {
+      len = read_block(fd, chunk->in, CHUNK_SIZE);
+    }
 
-static void buffer_signal_done(SharedBuffer *buffer) {
-  safe_sem_wait(&buffer->mutex);
-  buffer->done = 1;
-  safe_sem_post(&buffer->mutex);
-  safe_sem_post(&buffer->items);
+    chunk->in_len = len;
+    if (len == 0) {
+      safe_sem_post(&chunk->ready);
+      break;
+    }
+    stage_count_in(len);
+    stage_count_out(len);
+    safe_sem_post(&pool->work);
+  }
+
+  safe_sem_wait(&pool->mutex);
+  pool->chunk_count = seq;
+  pool->input_done = true;
+  safe_sem_post(&pool->mutex);
+  for (int i = 0; i < pool->workers; i++) {
+    safe_sem_post(&pool->work);
+  }
+
+  if (fd != -1) {
+    close_input(fd);
+  }
 }
 
-static void safe_sem_wait(sem_t *sem) {
-  while (sem_wait(sem) == -1) {
-    if (errno == EINTR) {
-      continue;
+/*
+ * Claims chunks in sequence order and squashes each one independently. The
+ * leading run of '*' is left to the sequencer, since whether its first star
+ * pairs up depends on how the previous chunk ended.
+ */
+static void squash_worker(ChunkPool *pool) {
+  for (;;) {
+    uint64_t wait_start = stats_clock();
+    safe_sem_wait(&pool->work);
+    stats_blocked(NULL, wait_start);
+    safe_sem_wait(&pool->mutex);
+    if (pool->input_done && pool->next_work == pool->chunk_count) {
+      safe_sem_post(&pool->mutex);
+      return;
     }
-    perror("sem_wait");
-    exit(EXIT_FAILURE);
+    size_t seq = pool->next_work++;
+    safe_sem_post(&pool->mutex);
+
+    Chunk *chunk = &pool->slots[seq % pool->slot_count];
+    size_t lead = 0;
+    while (lead < chunk->in_len && chunk->in[lead] == '*') {
+      lead++;
+    }
+
+    bool pending_star = false;
+    chunk->lead_stars = lead;
+    chunk->has_body = lead < chunk->in_len;
+    chunk->out_len =
+        chunk->has_body
+            ? g_kernels.squash_stars(&pending_star, chunk->in + lead,
+                                     chunk->in_len - lead, chunk->out)
+            : 0;
+    chunk->trailing_star = pending_star;
+    stage_count_in(chunk->in_len);
+    stage_count_out(lead + chunk->out_len);
+    safe_sem_post(&chunk->ready);
   }
 }
 
-static void safe_sem_post(sem_t *sem) {
-  if (sem_post(sem) == -1) {
-    perror("sem_post");
+/*
+ * Emits chunks strictly in sequence order. A '*' left pending by one chunk
+ * joins the leading star run of the next: the run collapses to '#' pairs and
+ * an odd star is either printed (the chunk has more text) or carried on.
+ */
+static void sequence_chunks(ChunkPool *pool, Channel *out) {
+  StageGroup sink = {0};
+  group_init(&sink, out);
+  char *stars = malloc(CHUNK_SIZE / 2 + 2);
+  if (!stars) {
+    perror("malloc");
     exit(EXIT_FAILURE);
   }
-}
 
-static void wait_for_child(pid_t pid) {
-  while (waitpid(pid, NULL, 0) == -1) {
-    if (errno == EINTR) {
-      continue;
+  bool carry = false;
+  for (size_t seq = 0;; seq++) {
+    Chunk *chunk = &pool->slots[seq % pool->slot_count];
+    uint64_t wait_start = stats_clock();
+    safe_sem_wait(&chunk->ready);
+    stats_blocked(NULL, wait_start);
+    if (chunk->in_len == 0) {
+      break;
     }
-    perror("waitpid");
-    break;
+    stage_count_in(chunk->lead_stars + chunk->out_len);
+
+    size_t run = chunk->lead_stars + (carry ? 1 : 0);
+    size_t n = run / 2;
+    memset(stars, '#', n);
+    if (chunk->has_body) {
+      if (run % 2 == 1) {
+        stars[n++] = '*';
+      }
+      carry = chunk->trailing_star;
+    } else {
+      carry = run % 2 == 1;
+    }
+
+    group_push_all(&sink, stars, n);
+    group_push_all(&sink, chunk->out, chunk->out_len);
+    safe_sem_post(&pool->free_slots);
+  }
+
+  if (carry) {
+    group_push_all(&sink, "*", 1);
   }
+  free(stars);
+  group_finish(&sink);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Returns a start time for the timers below, or 0 when stats are off. */
+static uint64_t stats_clock(void) {
+  return g_stats_enabled ? now_ns() : 0;
+}
+
+static void stats_add(atomic_ullong *counter, uint64_t value) {
+  if (g_stats_enabled) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+  }
+}
+
+/*
+ * Charges the time since `since` as blocked to a channel side (if any) and
+ * to the calling stage process.
+ */
+static void stats_blocked(SideStats *side, uint64_t since) {
+  if (!g_stats_enabled) {
+    return;
+  }
+  uint64_t ns = now_ns() - since;
+  if (side) {
+    atomic_fetch_add_explicit(&side->blocked_ns, ns, memory_order_relaxed);
+  }
+  if (g_self) {
+    atomic_fetch_add_explicit(&g_self->blocked_ns, ns, memory_order_relaxed);
+  }
+}
+
+static void stats_held(SideStats *side, uint64_t since) {
+  stats_add(&side->mutex_ns, g_stats_enabled ? now_ns() - since : 0);
+}
+
+static void stage_count_in(size_t len) {
+  if (g_self) {
+    stats_add(&g_self->bytes_in, len);
+  }
+}
+
+static void stage_count_out(size_t len) {
+  if (g_self) {
+    stats_add(&g_self->bytes_out, len);
+  }
+}
+
+/* Reserves a report row; called by the parent before it forks the stage. */
+static StageStats *stats_register(const char *name) {
+  if (!g_pipeline_stats || g_pipeline_stats->count == MAX_PROCESSES) {
+    return NULL;
+  }
+  StageStats *stats = &g_pipeline_stats->stages[g_pipeline_stats->count++];
+  snprintf(stats->name, sizeof(stats->name), "%s", name);
+  return stats;
+}
+
+/* Called first thing in a forked stage; stage_exit() closes the interval. */
+static void stage_enter(StageStats *stats) {
+  g_self = stats;
+  if (g_self) {
+    atomic_store(&g_self->start_ns, now_ns());
+  }
+}
+
+static void stage_exit(void) {
+  if (g_self) {
+    atomic_store(&g_self->end_ns, now_ns());
+  }
+}
+
+static void group_name(const StageGroup *group, char *out, size_t size) {
+  size_t used = 0;
+  out[0] = '\0';
+  for (size_t i = 0; i < group->count && used < size; i++) {
+    const Stage *stage = &group->stages[i];
+    int n = stage->type->needs_arg
+                ? snprintf(out + used, size - used, "%s%s:%d", i ? "+" : "",
+                           stage->type->name, stage->arg)
+                : snprintf(out + used, size - used, "%s%s", i ? "+" : "",
+                           stage->type->name);
+    used += n > 0 ? (size_t)n : 0;
+  }
+}
+
+static double ms(uint64_t ns) { return (double)ns / 1e6; }
+
+/*
+ * Per-stage totals. Busy is elapsed minus blocked time; the stage with the
+ * highest busy share is the one the others are waiting for.
+ */
+static void print_stats_report(Channel *channels, size_t channel_count) {
+  fprintf(stderr, "\n%-20s %10s %10s %10s %10s %6s\n", "stage", "MB in",
+          "MB out", "elapsed ms", "blocked ms", "busy");
+
+  const StageStats *bottleneck = NULL;
+  double bottleneck_busy = -1.0;
+  for (size_t i = 0; i < g_pipeline_stats->count; i++) {
+    const StageStats *stats = &g_pipeline_stats->stages[i];
+    uint64_t elapsed =
+        atomic_load(&stats->end_ns) - atomic_load(&stats->start_ns);
+    uint64_t blocked = atomic_load(&stats->blocked_ns);
+    if (blocked > elapsed) {
+      blocked = elapsed;
+    }
+    double busy = elapsed ? (double)(elapsed - blocked) / (double)elapsed : 0.0;
+    fprintf(stderr, "%-20s %10.2f %10.2f %10.1f %10.1f %5.1f%%\n", stats->name,
+            (double)atomic_load(&stats->bytes_in) / 1e6,
+            (double)atomic_load(&stats->bytes_out) / 1e6, ms(elapsed),
+            ms(blocked), busy * 100.0);
+    if (busy > bottleneck_busy) {
+      bottleneck_busy = busy;
+      bottleneck = stats;
+    }
+  }
+
+  fprintf(stderr, "\n%-8s %10s %14s %14s %12s %12s\n", "channel", "MB",
+          "spaces wait ms", "items wait ms", "push hold ms", "pop hold ms");
+  for (size_t i = 0; i < channel_count; i++) {
+    const ChannelStats *stats = channels[i].stats;
+    fprintf(stderr, "%zu -> %-3zu %10.2f %14.1f %14.1f %12.1f %12.1f\n", i,
+            i + 1, (double)atomic_load(&stats->push.bytes) / 1e6,
+            ms(atomic_load(&stats->push.blocked_ns)),
+            ms(atomic_load(&stats->pop.blocked_ns)),
+            ms(atomic_load(&stats->push.mutex_ns)),
+            ms(atomic_load(&stats->pop.mutex_ns)));
+  }
+
+  if (bottleneck) {
+    fprintf(stderr, "\nbottleneck: %s (busy %.1f%% of its run time)\n",
+            bottleneck->name, bottleneck_busy * 100.0);
+  }
+}
+
+/*
+ * Waits for the pipeline while printing, every interval_ms, each stage's
+ * output rate and blocked share over the last interval.
+ */
+static void sample_until_done(int interval_ms) {
+  uint64_t last_out[MAX_PROCESSES] = {0};
+  uint64_t last_blocked[MAX_PROCESSES] = {0};
+  uint64_t start = now_ns();
+  uint64_t last = start;
+  struct timespec period = {interval_ms / 1000,
+                            (long)(interval_ms % 1000) * 1000000L};
+
+  size_t running = g_task_count;
+  while (running > 0) {
+    nanosleep(&period, NULL);
+    running = tasks_running();
+
+    uint64_t now = now_ns();
+    double interval = (double)(now - last);
+    fprintf(stderr, "[%7.2fs]", (double)(now - start) / 1e9);
+    for (size_t i = 0; i < g_pipeline_stats->count; i++) {
+      const StageStats *stats = &g_pipeline_stats->stages[i];
+      uint64_t out = atomic_load(&stats->bytes_out);
+      uint64_t blocked = atomic_load(&stats->blocked_ns);
+      fprintf(stderr, " %s %.1fMB/s %.0f%%", stats->name,
+              (double)(out - last_out[i]) * 1e3 / interval,
+              (double)(blocked - last_blocked[i]) * 100.0 / interval);
+      last_out[i] = out;
+      last_blocked[i] = blocked;
+    }
+    fputc('\n', stderr);
+    last = now;
+  }
+}
+
+/*
+ * Forks a pipeline process. The child closes every pipe end it does not use,
+ * otherwise a consumer would never see end of file on its pipe.
+ */
+static pid_t fork_stage(Channel *in, Channel *out) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  for (size_t i = 0; i < g_channel_count; i++) {
+    Channel *channel = &g_channels[i];
+    if (channel->kind != BUFFER_PIPE) {
+      continue;
+    }
+    if (channel != in) {
+      close(channel->fds[0]);
+    }
+    if (channel != out) {
+      close(channel->fds[1]);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Reserves room for len bytes in the producer's gift area, page aligned so
+ * that every vmsplice() call maps to whole pipe buffers of its own. The area
+ * spans twice the pipe capacity: by the time a page comes round again the
+ * pipe can no longer hold a reference to its previous contents.
+ */
+static char *pipe_reserve(Channel *channel, size_t len) {
+  if (!channel->gift) {
+    channel->gift_size = 2 * channel->pipe_size;
+    channel->gift = mmap(NULL, channel->gift_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (channel->gift == MAP_FAILED) {
+      perror("mmap gift area");
+      exit(EXIT_FAILURE);
+    }
+    channel->gift_offset = 0;
+  }
+  if (channel->gift_offset + len > channel->gift_size) {
+    channel->gift_offset = 0;
+  }
+  return channel->gift + channel->gift_offset;
+}
+
+/* Hands the bytes written at the last pipe_reserve() to the pipe. */
+static void pipe_commit(Channel *channel, size_t len) {
+  struct iovec iov = {channel->gift + channel->gift_offset, len};
+  uint64_t wait_start = stats_clock();
+  while (iov.iov_len > 0) {
+    ssize_t n = vmsplice(channel->fds[1], &iov, 1, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("vmsplice");
+      exit(EXIT_FAILURE);
+    }
+    iov.iov_base = (char *)iov.iov_base + n;
+    iov.iov_len -= (size_t)n;
+  }
+  stats_blocked(&channel->stats->push, wait_start);
+  stats_add(&channel->stats->push.bytes, len);
+
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  channel->gift_offset = (channel->gift_offset + len + page - 1) & ~(page - 1);
+}
+
+/*
+ * Whether the producer may vmsplice() into this channel. Spliced pages stay
+ * referenced until the consumer copies them out; a passthrough consumer
+ * would splice them on to stdout instead, so it gets copied data.
+ */
+static bool pipe_can_gift(const Channel *channel, size_t len) {
+  return channel->kind == BUFFER_PIPE && !channel->consumer_splices &&
+         len <= channel->pipe_size;
+}
+
+static size_t pipe_push_n(Channel *channel, const char *src, size_t len) {
+  uint64_t wait_start = stats_clock();
+  ssize_t n;
+  while ((n = write(channel->fds[1], src, len)) == -1) {
+    if (errno != EINTR) {
+      perror("pipe write");
+      exit(EXIT_FAILURE);
+    }
+  }
+  stats_blocked(&channel->stats->push, wait_start);
+  stats_add(&channel->stats->push.bytes, (size_t)n);
+  return (size_t)n;
+}
+
+static size_t pipe_pop_n(Channel *channel, char *dst, size_t max) {
+  uint64_t wait_start = stats_clock();
+  ssize_t n;
+  while ((n = read(channel->fds[0], dst, max)) == -1) {
+    if (errno != EINTR) {
+      perror("pipe read");
+      exit(EXIT_FAILURE);
+    }
+  }
+  stats_blocked(&channel->stats->pop, wait_start);
+  stats_add(&channel->stats->pop.bytes, (size_t)n);
+  return (size_t)n;
+}
+
+static bool is_passthrough_group(const StageGroup *group) {
+  for (size_t i = 0; i < group->count; i++) {
+    if (group->stages[i].type->process != cat_process) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Moves everything from in_fd to out_fd with splice(), so the data never
+ * enters this process; time inside splice() counts as blocked. One side must
+ * be a pipe. Returns false without consuming anything when the kernel cannot
+ * splice between the two.
+ */
+static bool splice_all(int in_fd, Channel *in, int out_fd, Channel *out) {
+  bool moved = false;
+  for (;;) {
+    uint64_t wait_start = stats_clock();
+    ssize_t n = splice(in_fd, NULL, out_fd, NULL, SPLICE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    stats_blocked(NULL, wait_start);
+    if (n == 0) {
+      return true;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (!moved && errno == EINVAL) {
+        return false;
+      }
+      perror("splice");
+      exit(EXIT_FAILURE);
+    }
+    moved = true;
+    stage_count_in((size_t)n);
+    stage_count_out((size_t)n);
+    if (in) {
+      stats_add(&in->stats->pop.bytes, (uint64_t)n);
+    }
+    if (out) {
+      stats_add(&out->stats->push.bytes, (uint64_t)n);
+    }
+  }
+}
+
+/*
+ * A group of only `cat` stages connected to pipes (or the input file and
+ * stdout) forwards with splice(). Returns false when that is not possible
+ * and the group should run its stages normally.
+ */
+static bool run_passthrough(StageGroup *group, Channel *in, Channel *out) {
+  if (!is_passthrough_group(group) ||
+      (in && in->kind != BUFFER_PIPE) || (out && out->kind != BUFFER_PIPE) ||
+      (!in && !out)) {
+    return false;
+  }
+
+  int in_fd = in ? in->fds[0] : open_input(NULL);
+  if (in_fd == -1) {
+    return false;
+  }
+  int out_fd = out ? out->fds[1] : STDOUT_FILENO;
+  bool spliced = splice_all(in_fd, in, out_fd, out);
+  if (!in) {
+    close(in_fd);
+  }
+  if (spliced && out) {
+    channel_signal_done(out);
+  }
+  return spliced;
+}
+
+/*
+ * Opens the input file, or stdin for "-". When streaming is non-NULL, a
+ * pipe, FIFO or terminal is switched to non-blocking mode and *streaming is
+ * set, so the caller reads it with read_available() as data arrives instead
+ * of waiting for full blocks.
+ */
+static int open_input(bool *streaming) {
+  int fd = strcmp(g_input_path, "-") == 0 ? dup(STDIN_FILENO)
+                                          : open(g_input_path, O_RDONLY);
+  if (fd == -1) {
+    perror("reader open");
+    return -1;
+  }
+
+  struct stat st;
+  if (!streaming || fstat(fd, &st) == -1 || S_ISREG(st.st_mode)) {
+    return fd;
+  }
+  *streaming = true;
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && !(flags & O_NONBLOCK) &&
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+    g_input_nonblock_set = true;
+  }
+  return fd;
+}
+
+/* Closes fd, first undoing O_NONBLOCK, which stdin shares with the shell. */
+static void close_input(int fd) {
+  if (g_input_nonblock_set) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1) {
+      fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    g_input_nonblock_set = false;
+  }
+  close(fd);
+}
+
+static void read_input(StageGroup *group) {
+  bool streaming = false;
+  int fd = open_input(&streaming);
+  if (fd == -1) {
+    group_finish(group);
+    exit(EXIT_FAILURE);
+  }
+
+  if (!streaming && g_input_kind == INPUT_MMAP && read_mapped(fd, group)) {
+    close_input(fd);
+    return;
+  }
+
+  char *block = malloc(INPUT_BLOCK_SIZE);
+  if (!block) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t len;
+  while ((len = streaming ? read_available(fd, block, INPUT_BLOCK_SIZE)
+                          : read_block(fd, block, INPUT_BLOCK_SIZE)) > 0) {
+    stage_count_in(len);
+    group_push_all(group, block, len);
+  }
+
+  free(block);
+  close_input(fd);
+}
+
+/*
+ * Maps the whole file and feeds it to the stages straight out of the page
+ * cache. Returns false (and leaves fd untouched) when the file cannot be
+ * mapped, e.g. for a pipe, so the caller can fall back to read().
+ */
+static bool read_mapped(int fd, StageGroup *group) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  if (st.st_size == 0) {
+    return true;
+  }
+
+  size_t size = (size_t)st.st_size;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("reader mmap");
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  stage_count_in(size);
+  group_push_all(group, data, size);
+  munmap(data, size);
+  return true;
+}
+
+/* Fills dst with up to max bytes; returns 0 at end of file or on error. */
+static size_t read_block(int fd, char *dst, size_t max) {
+  size_t filled = 0;
+  while (filled < max) {
+    ssize_t n = read(fd, dst + filled, max - filled);
+    if (n == 0) {
+      break;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("reader read");
+      break;
+    }
+    filled += (size_t)n;
+  }
+  return filled;
+}
+
+/*
+ * Returns whatever a non-blocking descriptor has buffered (at least one
+ * byte, at most max), sleeping in poll() while it is empty; 0 at end of
+ * input or on error.
+ */
+static size_t read_available(int fd, char *dst, size_t max) {
+  for (;;) {
+    ssize_t n = read(fd, dst, max);
+    if (n >= 0) {
+      return (size_t)n;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("reader poll");
+        return 0;
+      }
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    perror("reader read");
+    return 0;
+  }
+}
+
+static void write_all(int fd, const char *src, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, src, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("printer write");
+      exit(EXIT_FAILURE);
+    }
+    src += n;
+    len -= (size_t)n;
+  }
+}
+
+static size_t cat_max_output(const Stage *stage, size_t len) {
+  (void)stage;
+  return len;
+}
+
+static size_t cat_process(Stage *stage, const char *in, size_t len,
+                          char *out) {
+  (void)stage;
+  memcpy(out, in, len);
+  return len;
+}
+
+static size_t eol_max_output(const Stage *stage, size_t len) {
+  (void)stage;
+  return len * (sizeof(EOL_MARKER) - 1);
+}
+
+static size_t eol_process(Stage *stage, const char *in, size_t len,
+                          char *out) {
+  (void)stage;
+  return g_kernels.expand_eol(in, len, out);
+}
+
+static size_t squash_max_output(const Stage *stage, size_t len) {
+  (void)stage;
+  return len + 1;
+}
+
+static size_t squash_process(Stage *stage, const char *in, size_t len,
+                             char *out) {
+  return g_kernels.squash_stars(&stage->pending_star, in, len, out);
+}
+
+static size_t squash_finish(Stage *stage, char *out) {
+  if (!stage->pending_star) {
+    return 0;
+  }
+  stage->pending_star = false;
+  out[0] = '*';
+  return 1;
+}
+
+static size_t wrap_max_output(const Stage *stage, size_t len) {
+  return len + len / (size_t)stage->arg + 1;
+}
+
+/* Breaks the stream into lines of stage->arg characters. */
+static size_t wrap_process(Stage *stage, const char *in, size_t len,
+                           char *out) {
+  size_t width = (size_t)stage->arg;
+  char *dst = out;
+  while (len > 0) {
+    size_t run = width - stage->column;
+    if (run > len) {
+      run = len;
+    }
+    memcpy(dst, in, run);
+    dst += run;
+    in += run;
+    len -= run;
+    stage->column += run;
+    if (stage->column == width) {
+      *dst++ = '\n';
+      stage->column = 0;
+    }
+  }
+  return (size_t)(dst - out);
+}
+
+static size_t wrap_finish(Stage *stage, char *out) {
+  if (stage->column == 0) {
+    return 0;
+  }
+  stage->column = 0;
+  out[0] = '\n';
+  return 1;
+}
+
+/* Replaces every newline with EOL_MARKER; out must hold 5 * len bytes. */
+static size_t expand_eol(const char *in, size_t len, char *out) {
+  static const char marker[] = EOL_MARKER;
+  size_t marker_len = sizeof(marker) - 1;
+  char *dst = out;
+
+  for (size_t i = 0; i < len; i++) {
+    if (in[i] == '\n') {
+      memcpy(dst, marker, marker_len);
+      dst += marker_len;
+    } else {
+      *dst++ = in[i];
+    }
+  }
+  return (size_t)(dst - out);
+}
+
+/*
+ * Collapses each "**" into '#'. A '*' at the end of a block is held in
+ * *pending_star until the next block shows whether it starts a pair; out
+ * must hold len + 1 bytes.
+ */
+static size_t squash_stars(bool *pending_star, const char *in, size_t len,
+                           char *out) {
+  char *dst = out;
+
+  for (size_t i = 0; i < len; i++) {
+    char ch = in[i];
+    if (*pending_star) {
+      *pending_star = false;
+      if (ch == '*') {
+        *dst++ = '#';
+        continue;
+      }
+      *dst++ = '*';
+    }
+    if (ch == '*') {
+      *pending_star = true;
+    } else {
+      *dst++ = ch;
+    }
+  }
+  return (size_t)(dst - out);
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Vector kernels. Each step loads a 16- or 32-byte window and turns the
+ * byte comparison into a bit mask; windows without a match are copied
+ * wholesale and only matching windows are walked bit by bit. Tails shorter
+ * than a window fall back to the scalar code, which shares the same
+ * pending_star carry, so results are identical however the stream is split.
+ */
+static inline char *emit_eol_window(const char *in, uint64_t mask,
+                                    unsigned width, char *dst) {
+  static const char marker[] = EOL_MARKER;
+  unsigned pos = 0;
+  while (mask != 0) {
+    unsigned next = (unsigned)__builtin_ctzll(mask);
+    memcpy(dst, in + pos, next - pos);
+    dst += next - pos;
+    memcpy(dst, marker, sizeof(marker) - 1);
+    dst += sizeof(marker) - 1;
+    pos = next + 1;
+    mask &= mask - 1;
+  }
+  memcpy(dst, in + pos, width - pos);
+  return dst + (width - pos);
+}
+
+static inline char *emit_squash_window(bool *pending_star, const char *in,
+                                       uint64_t mask, unsigned width,
+                                       char *dst) {
+  unsigned pos = 0;
+  while (pos < width) {
+    uint64_t rest = mask >> pos;
+    unsigned plain = rest ? (unsigned)__builtin_ctzll(rest) : width - pos;
+    if (plain > 0) {
+      if (*pending_star) {
+        *dst++ = '*';
+        *pending_star = false;
+      }
+      memcpy(dst, in + pos, plain);
+      dst += plain;
+      pos += plain;
+      continue;
+    }
+
+    /* width <= 32 leaves the high bits of rest clear, so ~rest is non-zero. */
+    unsigned run = (unsigned)__builtin_ctzll(~rest);
+    unsigned stars = run + (*pending_star ? 1u : 0u);
+    memset(dst, '#', stars / 2);
+    dst += stars / 2;
+    *pending_star = (stars & 1u) != 0;
+    pos += run;
+  }
+  return dst;
+}
+
+__attribute__((target("sse2"))) static size_t
+expand_eol_sse2(const char *in, size_t len, char *out) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  char *dst = out;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(in + i));
+    unsigned mask =
+        (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (mask == 0) {
+      _mm_storeu_si128((__m128i *)dst, chunk);
+      dst += 16;
+    } else {
+      dst = emit_eol_window(in + i, mask, 16, dst);
+    }
+  }
+  return (size_t)(dst - out) + expand_eol(in + i, len - i, dst);
+}
+
+__attribute__((target("sse2"))) static size_t
+squash_stars_sse2(bool *pending_star, const char *in, size_t len, char *out) {
+  const __m128i star = _mm_set1_epi8('*');
+  char *dst = out;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(in + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, star));
+    if (mask == 0 && !*pending_star) {
+      _mm_storeu_si128((__m128i *)dst, chunk);
+      dst += 16;
+    } else {
+      dst = emit_squash_window(pending_star, in + i, mask, 16, dst);
+    }
+  }
+  return (size_t)(dst - out) +
+         squash_stars(pending_star, in + i, len - i, dst);
+}
+
+__attribute__((target("avx2"))) static size_t
+expand_eol_avx2(const char *in, size_t len, char *out) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  char *dst = out;
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(in + i));
+    uint32_t mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+    if (mask == 0) {
+      _mm256_storeu_si256((__m256i *)dst, chunk);
+      dst += 32;
+    } else {
+      dst = emit_eol_window(in + i, mask, 32, dst);
+    }
+  }
+  return (size_t)(dst - out) + expand_eol(in + i, len - i, dst);
+}
+
+__attribute__((target("avx2"))) static size_t
+squash_stars_avx2(bool *pending_star, const char *in, size_t len, char *out) {
+  const __m256i star = _mm256_set1_epi8('*');
+  char *dst = out;
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(in + i));
+    uint32_t mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, star));
+    if (mask == 0 && !*pending_star) {
+      _mm256_storeu_si256((__m256i *)dst, chunk);
+      dst += 32;
+    } else {
+      dst = emit_squash_window(pending_star, in + i, mask, 32, dst);
+    }
+  }
+  return (size_t)(dst - out) +
+         squash_stars(pending_star, in + i, len - i, dst);
+}
+#endif
+
+static KernelSet select_kernels(KernelKind kind) {
+  KernelSet scalar = {"scalar", expand_eol, squash_stars};
+#ifdef HAVE_X86_KERNELS
+  KernelSet sse2 = {"sse2", expand_eol_sse2, squash_stars_sse2};
+  KernelSet avx2 = {"avx2", expand_eol_avx2, squash_stars_avx2};
+  bool has_avx2 = __builtin_cpu_supports("avx2");
+
+  if (kind == KERNEL_AUTO) {
+    return has_avx2 ? avx2 : sse2;
+  }
+  if (kind == KERNEL_AVX2 && !has_avx2) {
+    fprintf(stderr, "AVX2 not supported here, using SSE2 kernels\n");
+    return sse2;
+  }
+  if (kind == KERNEL_AVX2) {
+    return avx2;
+  }
+  if (kind == KERNEL_SSE2) {
+    return sse2;
+  }
+#else
+  if (kind == KERNEL_SSE2 || kind == KERNEL_AVX2) {
+    fprintf(stderr, "SIMD kernels need x86-64, using scalar kernels\n");
+  }
+#endif
+  return scalar;
+}
+
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Runs one stage kernel over the whole input in BLOCK_SIZE pieces, the way
+ * the pipeline stages call it, and returns the number of output bytes.
+ */
+static size_t run_stage_kernel(const KernelSet *set, bool squash,
+                               const char *in, size_t len, char *out) {
+  bool pending_star = false;
+  size_t out_len = 0;
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    size_t n = len - i < BLOCK_SIZE ? len - i : BLOCK_SIZE;
+    out_len += squash ? set->squash_stars(&pending_star, in + i, n,
+                                          out + out_len)
+                      : set->expand_eol(in + i, n, out + out_len);
+  }
+  if (pending_star) {
+    out[out_len++] = '*';
+  }
+  return out_len;
+}
+
+/*
+ * Cross-checks every kernel against the scalar one on randomly split input
+ * (so pending '*' crosses arbitrary boundaries), then reports throughput per
+ * stage for sparse and dense text.
+ */
+static int bench_kernels(int megabytes) {
+  KernelSet sets[3];
+  size_t set_count = 0;
+  sets[set_count++] = select_kernels(KERNEL_SCALAR);
+#ifdef HAVE_X86_KERNELS
+  sets[set_count++] = select_kernels(KERNEL_SSE2);
+  if (__builtin_cpu_supports("avx2")) {
+    sets[set_count++] = select_kernels(KERNEL_AVX2);
+  }
+#endif
+
+  size_t len = (size_t)megabytes << 20;
+  char *in = malloc(len);
+  char *expected = malloc(len * (sizeof(EOL_MARKER) - 1) + 1);
+  char *out = malloc(len * (sizeof(EOL_MARKER) - 1) + 1);
+  if (!in || !expected || !out) {
+    perror("malloc");
+    free(in);
+    free(expected);
+    free(out);
+    return EXIT_FAILURE;
+  }
+
+  static const struct {
+    const char *name;
+    unsigned star_per_mille;
+    unsigned newline_per_mille;
+  } profiles[] = {{"sparse", 2, 15}, {"dense", 120, 40}};
+
+  int status = EXIT_SUCCESS;
+  unsigned seed = 12345;
+  for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245u + 12345u;
+      unsigned roll = (seed >> 16) % 1000;
+      if (roll < profiles[p].star_per_mille) {
+        in[i] = '*';
+      } else if (roll < profiles[p].star_per_mille +
+                            profiles[p].newline_per_mille) {
+        in[i] = '\n';
+      } else {
+        in[i] = (char)('a' + roll % 26);
+      }
+    }
+
+    for (int squash = 0; squash <= 1; squash++) {
+      size_t checked = len < SPLIT_CHECK_BYTES ? len : SPLIT_CHECK_BYTES;
+      size_t reference_len =
+          run_stage_kernel(&sets[0], squash, in, checked, expected);
+      for (size_t k = 1; k < set_count; k++) {
+        bool pending_star = false;
+        size_t out_len = 0;
+        for (size_t i = 0; i < checked;) {
+          seed = seed * 1103515245u + 12345u;
+          size_t n = 1 + (seed >> 16) % 97;
+          if (n > checked - i) {
+            n = checked - i;
+          }
+          out_len += squash ? sets[k].squash_stars(&pending_star, in + i, n,
+                                                   out + out_len)
+                            : sets[k].expand_eol(in + i, n, out + out_len);
+          i += n;
+        }
+        if (pending_star) {
+          out[out_len++] = '*';
+        }
+        if (out_len != reference_len ||
+            memcmp(out, expected, out_len) != 0) {
+          fprintf(stderr, "%s %s kernel disagrees with scalar on %s input\n",
+                  sets[k].name, squash ? "squash" : "eol", profiles[p].name);
+          status = EXIT_FAILURE;
+        }
+      }
+
+      size_t expected_len =
+          run_stage_kernel(&sets[0], squash, in, len, expected);
+      for (size_t k = 0; k < set_count; k++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t out_len = run_stage_kernel(&sets[k], squash, in, len, out);
+        double seconds = seconds_since(&start);
+        if (out_len != expected_len || memcmp(out, expected, out_len) != 0) {
+          fprintf(stderr, "%s %s kernel output mismatch\n", sets[k].name,
+                  squash ? "squash" : "eol");
+          status = EXIT_FAILURE;
+        }
+        printf("%-6s %-7s %-6s %8.1f MB/s\n", squash ? "squash" : "eol",
+               profiles[p].name, sets[k].name,
+               (double)len / (1 << 20) / seconds);
+      }
+    }
+  }
+
+  free(in);
+  free(expected);
+  free(out);
+  return status;
+}
+
+static Channel channel_create(BufferKind kind) {
+  Channel channel = {.kind = kind, .fds = {-1, -1}};
+  if (kind == BUFFER_PIPE) {
+    if (pipe(channel.fds) == -1) {
+      perror("pipe");
+      exit(EXIT_FAILURE);
+    }
+    /* Best effort: unprivileged users are capped at fs.pipe-max-size. */
+    fcntl(channel.fds[1], F_SETPIPE_SZ, PIPE_CAPACITY);
+    int pipe_size = fcntl(channel.fds[1], F_GETPIPE_SZ);
+    channel.pipe_size = pipe_size > 0 ? (size_t)pipe_size : BUF_SIZE;
+    channel.stats = mmap(NULL, sizeof(ChannelStats), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (channel.stats == MAP_FAILED) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+    }
+    return channel;
+  }
+
+  size_t size = sizeof(SharedBuffer);
+  if (kind == BUFFER_SPSC) {
+    size = sizeof(SpscRing) + BUF_SIZE;
+  } else if (kind == BUFFER_MAGIC) {
+    size = sizeof(SpscRing);
+  }
+  void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  if (kind == BUFFER_SPSC || kind == BUFFER_MAGIC) {
+    channel.ring = shared;
+    channel.data = kind == BUFFER_SPSC ? channel.ring->data
+                                       : map_magic_ring(g_ring_capacity);
+    channel.capacity = kind == BUFFER_SPSC ? BUF_SIZE : g_ring_capacity;
+    atomic_init(&channel.ring->tail, 0);
+    atomic_init(&channel.ring->head, 0);
+    atomic_init(&channel.ring->done, 0);
+    atomic_init(&channel.ring->consumer_waiting, 0);
+    atomic_init(&channel.ring->producer_waiting, 0);
+    channel.stats = &channel.ring->stats;
+  } else {
+    channel.buffer = shared;
+    buffer_init(channel.buffer);
+    channel.stats = &channel.buffer->stats;
+  }
+  return channel;
+}
+
+/* Drops the parent's pipe ends once every stage has been forked. */
+static void channel_release(Channel *channel) {
+  if (channel->kind != BUFFER_PIPE) {
+    return;
+  }
+  close(channel->fds[0]);
+  close(channel->fds[1]);
+  channel->fds[0] = -1;
+  channel->fds[1] = -1;
+}
+
+static void channel_destroy(Channel *channel) {
+  if (channel->kind == BUFFER_PIPE) {
+    channel_release(channel);
+    munmap(channel->stats, sizeof(*channel->stats));
+  } else if (channel->kind == BUFFER_SPSC) {
+    munmap(channel->ring, sizeof(*channel->ring) + BUF_SIZE);
+  } else if (channel->kind == BUFFER_MAGIC) {
+    munmap(channel->data, 2 * channel->capacity);
+    munmap(channel->ring, sizeof(*channel->ring));
+  } else {
+    buffer_destroy(channel->buffer);
+    munmap(channel->buffer, sizeof(*channel->buffer));
+  }
+}
+
+static size_t channel_push_n(Channel *channel, const char *src, size_t len) {
+  if (channel->kind == BUFFER_PIPE) {
+    return pipe_push_n(channel, src, len);
+  }
+  if (channel->kind == BUFFER_SPSC || channel->kind == BUFFER_MAGIC) {
+    return ring_push_n(channel, src, len);
+  }
+  return buffer_push_n(channel->buffer, src, len);
+}
+
+static size_t channel_pop_n(Channel *channel, char *dst, size_t max) {
+  if (channel->kind == BUFFER_PIPE) {
+    return pipe_pop_n(channel, dst, max);
+  }
+  if (channel->kind == BUFFER_SPSC || channel->kind == BUFFER_MAGIC) {
+    return ring_pop_n(channel, dst, max);
+  }
+  return buffer_pop_n(channel->buffer, dst, max);
+}
+
+static void channel_write_all(Channel *channel, const char *src, size_t len) {
+  while (len > 0) {
+    size_t n = channel_push_n(channel, src, len);
+    src += n;
+    len -= n;
+  }
+}
+
+static void channel_signal_done(Channel *channel) {
+  if (channel->kind == BUFFER_PIPE) {
+    close(channel->fds[1]);
+    channel->fds[1] = -1;
+  } else if (channel->kind == BUFFER_SPSC || channel->kind == BUFFER_MAGIC) {
+    ring_signal_done(channel->ring);
+  } else {
+    buffer_signal_done(channel->buffer);
+  }
+}
+
+static void buffer_init(SharedBuffer *buffer) {
+  buffer->head = 0;
+  buffer->tail = 0;
+  buffer->count = 0;
+  buffer->done = 0;
+  buffer->reader_waiting = 0;
+  buffer->writer_waiting = 0;
+
+  /* The thread backend gets process-private semaphores. */
+  int pshared = g_backend == BACKEND_PROCESS;
+  if (sem_init(&buffer->mutex, pshared, 1) == -1 ||
+      sem_init(&buffer->items, pshared, 0) == -1 ||
+      sem_init(&buffer->spaces, pshared, 0) == -1) {
+    perror("sem_init");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void buffer_destroy(SharedBuffer *buffer) {
+  sem_destroy(&buffer->mutex);
+  sem_destroy(&buffer->items);
+  sem_destroy(&buffer->spaces);
+}
+
+/*
+ * `items` and `spaces` are wake-up signals rather than byte counters: a side
+ * that finds the buffer empty (or full) flags itself as waiting and sleeps,
+ * and the other side posts once after it has made progress.
+ *
+ * Copies up to len bytes into the contiguous free region after tail in one
+ * critical section and returns how many were written.
+ */
+static size_t buffer_push_n(SharedBuffer *buffer, const char *src,
+                            size_t len) {
+  SideStats *stats = &buffer->stats.push;
+  safe_sem_wait(&buffer->mutex);
+  uint64_t held_since = stats_clock();
+  while (buffer->count == BUF_SIZE) {
+    buffer->writer_waiting = 1;
+    stats_held(stats, held_since);
+    safe_sem_post(&buffer->mutex);
+    uint64_t wait_start = stats_clock();
+    safe_sem_wait(&buffer->spaces);
+    stats_blocked(stats, wait_start);
+    safe_sem_wait(&buffer->mutex);
+    held_since = stats_clock();
+  }
+
+  size_t n = BUF_SIZE - buffer->count;
+  if (n > BUF_SIZE - buffer->tail) {
+    n = BUF_SIZE - buffer->tail;
+  }
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(&buffer->data[buffer->tail], src, n);
+  buffer->tail = (buffer->tail + n) % BUF_SIZE;
+  buffer->count += n;
+
+  if (buffer->reader_waiting) {
+    buffer->reader_waiting = 0;
+    safe_sem_post(&buffer->items);
+  }
+  stats_add(&stats->bytes, n);
+  stats_held(stats, held_since);
+  safe_sem_post(&buffer->mutex);
+  return n;
+}
+
+/*
+ * Copies up to max bytes from the contiguous used region after head. Returns
+ * 0 only once the producer is done and the buffer has been drained.
+ */
+static size_t buffer_pop_n(SharedBuffer *buffer, char *dst, size_t max) {
+  SideStats *stats = &buffer->stats.pop;
+  safe_sem_wait(&buffer->mutex);
+  uint64_t held_since = stats_clock();
+  while (buffer->count == 0) {
+    if (buffer->done) {
+      stats_held(stats, held_since);
+      safe_sem_post(&buffer->mutex);
+      return 0;
+    }
+    buffer->reader_waiting = 1;
+    stats_held(stats, held_since);
+    safe_sem_post(&buffer->mutex);
+    uint64_t wait_start = stats_clock();
+    safe_sem_wait(&buffer->items);
+    stats_blocked(stats, wait_start);
+    safe_sem_wait(&buffer->mutex);
+    held_since = stats_clock();
+  }
+
+  size_t n = buffer->count;
+  if (n > BUF_SIZE - buffer->head) {
+    n = BUF_SIZE - buffer->head;
+  }
+  if (n > max) {
+    n = max;
+  }
+
+  memcpy(dst, &buffer->data[buffer->head], n);
+  buffer->head = (buffer->head + n) % BUF_SIZE;
+  buffer->count -= n;
+
+  if (buffer->writer_waiting) {
+    buffer->writer_waiting = 0;
+    safe_sem_post(&buffer->spaces);
+  }
+  stats_add(&stats->bytes, n);
+  stats_held(stats, held_since);
+  safe_sem_post(&buffer->mutex);
+  return n;
+}
+
+static void buffer_signal_done(SharedBuffer *buffer) {
+  safe_sem_wait(&buffer->mutex);
+  buffer->done = 1;
+  if (buffer->reader_waiting) {
+    buffer->reader_waiting = 0;
+    safe_sem_post(&buffer->items);
+  }
+  safe_sem_post(&buffer->mutex);
+}
+
+/*
+ * Blocks until at least min bytes (at most the capacity) are free and
+ * returns the free byte count. The index stores below are sequentially
+ * consistent so that they pair with the peer's "set waiting flag, then
+ * re-check the index" sequence: either the sleeper sees the new index, or
+ * the other side sees its flag and wakes it.
+ */
+static size_t ring_wait_space(Channel *channel, size_t min) {
+  SpscRing *ring = channel->ring;
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t space = channel->capacity - (tail - channel->cached_head);
+
+  while (space < min) {
+    channel->cached_head =
+        atomic_load_explicit(&ring->head, memory_order_acquire);
+    space = channel->capacity - (tail - channel->cached_head);
+    if (space >= min) {
+      break;
+    }
+    atomic_store(&ring->producer_waiting, 1);
+    channel->cached_head = atomic_load(&ring->head);
+    space = channel->capacity - (tail - channel->cached_head);
+    if (space < min) {
+      uint64_t wait_start = stats_clock();
+      futex_wait(&ring->producer_waiting, 1);
+      stats_blocked(&ring->stats.push, wait_start);
+    }
+    atomic_store_explicit(&ring->producer_waiting, 0, memory_order_relaxed);
+  }
+  return space;
+}
+
+/* Blocks until data is available; returns 0 once the producer is done. */
+static size_t ring_wait_data(Channel *channel) {
+  SpscRing *ring = channel->ring;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t used = channel->cached_tail - head;
+
+  while (used == 0) {
+    channel->cached_tail =
+        atomic_load_explicit(&ring->tail, memory_order_acquire);
+    used = channel->cached_tail - head;
+    if (used > 0) {
+      break;
+    }
+    atomic_store(&ring->consumer_waiting, 1);
+    int done = atomic_load(&ring->done);
+    channel->cached_tail = atomic_load(&ring->tail);
+    used = channel->cached_tail - head;
+    if (used == 0) {
+      if (done) {
+        atomic_store_explicit(&ring->consumer_waiting, 0,
+                              memory_order_relaxed);
+        return 0;
+      }
+      uint64_t wait_start = stats_clock();
+      futex_wait(&ring->consumer_waiting, 1);
+      stats_blocked(&ring->stats.pop, wait_start);
+    }
+    atomic_store_explicit(&ring->consumer_waiting, 0, memory_order_relaxed);
+  }
+  return used;
+}
+
+static void ring_publish(Channel *channel, size_t n) {
+  SpscRing *ring = channel->ring;
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store(&ring->tail, tail + n);
+  stats_add(&ring->stats.push.bytes, n);
+  if (atomic_load(&ring->consumer_waiting)) {
+    atomic_store_explicit(&ring->consumer_waiting, 0, memory_order_relaxed);
+    futex_wake(&ring->consumer_waiting);
+  }
+}
+
+static void ring_release(Channel *channel, size_t n) {
+  SpscRing *ring = channel->ring;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store(&ring->head, head + n);
+  stats_add(&ring->stats.pop.bytes, n);
+  if (atomic_load(&ring->producer_waiting)) {
+    atomic_store_explicit(&ring->producer_waiting, 0, memory_order_relaxed);
+    futex_wake(&ring->producer_waiting);
+  }
+}
+
+/*
+ * Copying push/pop. On the plain ring a copy stops at the end of the data
+ * array; on the magic ring the second mapping makes every window contiguous.
+ */
+static size_t ring_push_n(Channel *channel, const char *src, size_t len) {
+  size_t space = ring_wait_space(channel, 1);
+  size_t offset =
+      atomic_load_explicit(&channel->ring->tail, memory_order_relaxed) %
+      channel->capacity;
+  size_t n = space;
+  if (channel->kind != BUFFER_MAGIC && n > channel->capacity - offset) {
+    n = channel->capacity - offset;
+  }
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(channel->data + offset, src, n);
+  ring_publish(channel, n);
+  return n;
+}
+
+static size_t ring_pop_n(Channel *channel, char *dst, size_t max) {
+  size_t used = ring_wait_data(channel);
+  if (used == 0) {
+    return 0;
+  }
+  size_t offset =
+      atomic_load_explicit(&channel->ring->head, memory_order_relaxed) %
+      channel->capacity;
+  size_t n = used;
+  if (channel->kind != BUFFER_MAGIC && n > channel->capacity - offset) {
+    n = channel->capacity - offset;
+  }
+  if (n > max) {
+    n = max;
+  }
+
+  memcpy(dst, channel->data + offset, n);
+  ring_release(channel, n);
+  return n;
+}
+
+/*
+ * Zero-copy access to the magic ring: magic_reserve() waits for len free
+ * bytes and returns where to write them, magic_commit() publishes what was
+ * written. magic_peek()/magic_consume() are the consumer's counterparts.
+ */
+static char *magic_reserve(Channel *channel, size_t len) {
+  ring_wait_space(channel, len);
+  size_t tail =
+      atomic_load_explicit(&channel->ring->tail, memory_order_relaxed);
+  return channel->data + tail % channel->capacity;
+}
+
+static void magic_commit(Channel *channel, size_t len) {
+  ring_publish(channel, len);
+}
+
+/* Returns the readable window (capped at a quarter of the ring), 0 at end. */
+static size_t magic_peek(Channel *channel, const char **window) {
+  size_t used = ring_wait_data(channel);
+  size_t head =
+      atomic_load_explicit(&channel->ring->head, memory_order_relaxed);
+  size_t limit = channel->capacity / 4 > BLOCK_SIZE ? channel->capacity / 4
+                                                    : BLOCK_SIZE;
+  *window = channel->data + head % channel->capacity;
+  return used < limit ? used : limit;
+}
+
+static void magic_consume(Channel *channel, size_t len) {
+  ring_release(channel, len);
+}
+
+/*
+ * Maps one memfd twice, back to back, so byte capacity + i is byte i: any
+ * window of up to capacity bytes that starts in the first copy is
+ * contiguous. With huge pages the file lives in hugetlbfs, which needs both
+ * the size and the mapping address aligned to HUGE_PAGE_SIZE.
+ */
+static char *map_magic_ring(size_t capacity) {
+  unsigned int flags = MFD_CLOEXEC;
+  size_t align = (size_t)sysconf(_SC_PAGESIZE);
+  if (g_huge_pages) {
+    flags |= MFD_HUGETLB;
+    align = HUGE_PAGE_SIZE;
+  }
+
+  int fd = memfd_create("lab5-ring", flags);
+  if (fd == -1) {
+    perror("memfd_create");
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(fd, (off_t)capacity) == -1) {
+    perror("ftruncate ring");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t span = 2 * capacity + align;
+  char *area = mmap(NULL, span, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (area == MAP_FAILED) {
+    perror("mmap ring reservation");
+    exit(EXIT_FAILURE);
+  }
+  char *base =
+      (char *)(((uintptr_t)area + align - 1) & ~(uintptr_t)(align - 1));
+  if (base > area) {
+    munmap(area, (size_t)(base - area));
+  }
+  munmap(base + 2 * capacity, (size_t)(area + span - (base + 2 * capacity)));
+
+  for (int copy = 0; copy < 2; copy++) {
+    if (mmap(base + copy * capacity, capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      perror(g_huge_pages ? "mmap ring (are huge pages reserved?)"
+                          : "mmap ring");
+      exit(EXIT_FAILURE);
+    }
+  }
+  close(fd);
+  return base;
+}
+
+static void ring_signal_done(SpscRing *ring) {
+  atomic_store(&ring->done, 1);
+  if (atomic_load(&ring->consumer_waiting)) {
+    atomic_store_explicit(&ring->consumer_waiting, 0, memory_order_relaxed);
+    futex_wake(&ring->consumer_waiting);
+  }
+}
+
+static void futex_wait(atomic_int *word, int expected) {
+  int op = g_backend == BACKEND_THREAD ? FUTEX_WAIT_PRIVATE : FUTEX_WAIT;
+  if (syscall(SYS_futex, word, op, expected, NULL, NULL, 0) == -1 &&
+      errno != EAGAIN && errno != EINTR) {
+    perror("futex wait");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void futex_wake(atomic_int *word) {
+  int op = g_backend == BACKEND_THREAD ? FUTEX_WAKE_PRIVATE : FUTEX_WAKE;
+  if (syscall(SYS_futex, word, op, 1, NULL, NULL, 0) == -1) {
+    perror("futex wake");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void safe_sem_wait(sem_t *sem) {
+  while (sem_wait(sem) == -1) {
+    if (errno == EINTR) {
+      continue;
+    }
+    perror("sem_wait");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void safe_sem_post(sem_t *sem) {
+  if (sem_post(sem) == -1) {
+    perror("sem_post");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void wait_for_child(pid_t pid) {
+  while (waitpid(pid, NULL, 0) == -1) {
+    if (errno == EINTR) {
+      continue;
+    }
+    perror("waitpid");
+    break;
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [input_file|-] [line_width]\n"
+          "  -b, --buffer KIND   sem (semaphore buffer, default), spsc "
+          "(lock-free ring)\n"
+          "                      pipe (vmsplice/splice over pipes) or magic\n"
+          "                      (double-mapped memfd ring)\n"
+          "  -c, --capacity SIZE magic ring size, e.g. 64K, 2M (default 1M)\n"
+          "      --huge-pages    back the magic ring with 2 MiB huge pages\n"
+          "  -i, --input KIND    read (1 MiB read() blocks, default) or mmap\n"
+          "  -s, --stages SPEC   stage list, ',' between processes and '+' "
+          "between\n"
+          "                      fused stages (default eol,squash,wrap:WIDTH)\n"
+          "  -w, --workers K     run each standalone squash stage on K "
+          "worker processes\n"
+          "  -l, --max-latency MS  flush pending output at most MS ms "
+          "after\n"
+          "                      it was produced\n"
+          "      --stats[=MS]    print per-stage counters at exit, and every "
+          "MS ms\n"
+          "      --backend KIND  process (fork per stage, default) or thread\n"
+          "      --pin           pin each stage to its own CPU\n"
+          "      --compare-backends[=RUNS]  time both backends, output to "
+          "/dev/null\n"
+          "  -k, --kernel KIND   auto (default), scalar, sse2 or avx2 stage "
+          "kernels\n"
+          "      --bench-kernels[=MB]  verify and time the stage kernels\n",
+          prog);
+}
+
+/* Parses a byte count with an optional K, M or G suffix (powers of two). */
+static int parse_size(const char *text, const char *label, size_t *value_out) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  unsigned shift = 0;
+  if (end != text && *end != '\0' && end[1] == '\0') {
+    switch (*end) {
+    case 'K':
+    case 'k':
+      shift = 10;
+      end++;
+      break;
+    case 'M':
+    case 'm':
+      shift = 20;
+      end++;
+      break;
+    case 'G':
+    case 'g':
+      shift = 30;
+      end++;
+      break;
+    }
+  }
+  if (errno != 0 || end == text || *end != '\0' || value == 0 ||
+      value > (SIZE_MAX >> shift)) {
+    fprintf(stderr, "Invalid %s: %s\n", label, text);
+    return -1;
+  }
+  *value_out = (size_t)value << shift;
+  return 0;
 }
 
 static int parse_positive_int(const char *text, const char *label,
@@ -1,124 +1,553 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <pthread.h>
 #include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX_LINE_LENGTH 128
 #define MODEL_LEN 50
+#define MAX_ARRIVAL_NS 500000000ull
+#define MIN_PARK_S 1
+#define PARK_RANGE_S 3
+#define THREAD_STACK_SIZE (64 * 1024)
+#define CACHE_LINE 64
+#define MAX_LEVELS 64
+#define BENCH_THREADS 8
+#define BENCH_DEFAULT_LEVELS 16
+#define BENCH_DURATION_NS 1000000000ull
+
+#define WAIT_BUCKETS 32
+#define SAMPLE_SLOTS 4096
+#define DEFAULT_SAMPLE_MS 100
+#define READ_BUFFER_SIZE (1 << 20)
+#define RELEASE_CHUNK (8u << 20)
+#define REAP_BATCH 256
+#define DEFAULT_RATE 100.0
+#define DEFAULT_MIX "C=7,T=3"
+
+#define SUMMARY_COUNT_SHIFT 8
+#define SUMMARY_COUNT_MASK 0x7fffff
+#define SUMMARY_LOCKED (1ull << 31)
+#define SUMMARY_SAME_SHIFT 32
+#define SUMMARY_OTHER_SHIFT 48
+#define SUMMARY_WAIT_MAX 0xffff
+#define SUMMARY_SLOW_MASK (SUMMARY_LOCKED | ~0ull << SUMMARY_SAME_SHIFT)
 
 #define TYPE_NONE 0
-#define TYPE_CAR 1
-#define TYPE_TRUCK 2
+#define MAX_TYPES 8
+
+typedef enum { BACKEND_PROCESS, BACKEND_THREAD, BACKEND_EVENT } Backend;
+typedef enum {
+  POLICY_ALTERNATE,
+  POLICY_LARGEST,
+  POLICY_QUOTA,
+  POLICY_WEIGHTED,
+} PolicyKind;
 
 typedef struct {
   char model[MODEL_LEN];
   int type;
+  int id;
+  uint64_t arrival_ns;
+  uint64_t park_ns;
+  int level;
+  int next_waiting;
 } Vehicle;
 
+/*
+ * Reads vehicles one line at a time: a regular file is mapped and walked in
+ * place (the pages behind the cursor are dropped every RELEASE_CHUNK), while
+ * stdin or a pipe goes through one READ_BUFFER_SIZE buffer. Times are
+ * planned as each line is read, so a run never holds more than the vehicles
+ * in flight. limit is number_of_vehicles, or 0 for the whole input.
+ */
+typedef struct {
+  const char *path;
+  int fd;
+  char *data;
+  size_t size;
+  size_t pos;
+  size_t released;
+  bool mapped;
+  bool eof;
+  bool failed;
+  int limit;
+  int count;
+  int late;
+  uint64_t rng;
+  uint64_t last_arrival_ns;
+  double untimed_ns;
+} VehicleReader;
+
+/*
+ * The vehicles in flight in the event backend. Free slots are chained
+ * through next_waiting and reused, so the pool grows to the peak number of
+ * vehicles in the garage or queueing for it.
+ */
+typedef struct {
+  Vehicle *items;
+  int capacity;
+  int free_head;
+  int in_use;
+  int peak;
+} VehiclePool;
+
+typedef struct {
+  Backend backend;
+  double speedup;
+  uint64_t seed;
+  bool quiet;
+  int levels;
+  PolicyKind policy;
+  const char *policy_spec;
+  int quota;
+  int weights[MAX_TYPES + 1];
+  const char *telemetry_path;
+  int sample_ms;
+  bool track_occupancy;
+  bool virtual_time;
+  double rate;
+  int mix[MAX_TYPES + 1];
+  bool fast_path;
+} Options;
+
+/*
+ * The vehicles of one type queued on a level. waiting and grants are
+ * protected by the level lock; a waiter sleeps on wake_seq (a futex word)
+ * until a grant is there for it to claim.
+ */
+typedef struct {
+  int waiting;
+  int grants;
+  atomic_int wake_seq;
+} TypeQueue;
+
+/*
+ * Per-type totals of one level, updated under its lock. wait_hist[b] counts
+ * waits below 2^b microseconds (and at least 2^(b-1)); the phase fields
+ * cover the finished phases of this type, idle_spot_ns being the free
+ * spot-time inside them.
+ */
+typedef struct {
+  uint64_t parked;
+  uint64_t wait_sum_ns;
+  uint64_t wait_max_ns;
+  uint64_t wait_hist[WAIT_BUCKETS];
+  uint64_t phases;
+  uint64_t phase_sum_ns;
+  uint64_t phase_max_ns;
+  uint64_t idle_spot_ns;
+} TypeStats;
+
+/*
+ * One level of the garage: its own spots, type state and lock. summary
+ * packs current_type, count_inside and the waiting counts (see
+ * level_publish()) so arrivals can pick a level without taking any lock,
+ * and is also the word the fast path admits and releases on. While the
+ * lock is held, current_type and count_inside are the truth and summary
+ * carries SUMMARY_LOCKED; otherwise fast-path vehicles may move
+ * count_inside in summary alone (level_lock() reads it back). Fast
+ * admissions are counted in fast_admitted until the next lock folds them in.
+ * A phase is a stretch during which one type holds the level.
+ *
+ * occupied_ns integrates the occupancy over garage_clock() time (in
+ * spot-nanoseconds) and occupied_slots splits the same integral into
+ * sample periods; every departure adds its stay to both (level_account()).
+ */
 typedef struct {
-  sem_t mutex;
-  sem_t car_queue;
-  sem_t truck_queue;
+  _Alignas(CACHE_LINE) sem_t mutex;
   int current_type;
   int last_type;
   int count_inside;
   int spots;
-  int waiting_cars;
-  int waiting_trucks;
+  int waiting_total;
+  int phase_admitted;
+  uint64_t phase_switches;
+  uint64_t phase_start_ns;
+  uint64_t phase_start_occupied_ns;
+  bool locked;
+  TypeQueue queues[MAX_TYPES + 1];
+  TypeStats stats[MAX_TYPES + 1];
+  _Atomic uint64_t occupied_ns;
+  _Atomic uint64_t occupied_slots[SAMPLE_SLOTS];
+  _Atomic uint64_t fast_admitted;
+  _Atomic uint64_t summary;
+} Level;
+
+/* end_ns is garage_clock() when the run ended. */
+typedef struct {
+  int level_count;
+  uint64_t end_ns;
+  Level levels[];
 } Garage;
 
+/* Context handed to one vehicle thread, freed by the thread. */
+typedef struct {
+  Vehicle vehicle;
+  Garage *garage;
+  sem_t *done;
+} VehicleTask;
+
+/* One admission benchmark thread. */
+typedef struct {
+  Garage *garage;
+  atomic_bool *stop;
+  uint64_t seed;
+  int truck_percent;
+  uint64_t admissions;
+} BenchWorker;
+
+typedef enum { EVENT_ARRIVAL, EVENT_DEPARTURE } EventType;
+
+typedef struct {
+  uint64_t time_ns;
+  uint64_t seq;
+  EventType type;
+  int vehicle_id;
+} Event;
+
+typedef struct {
+  Event *items;
+  size_t count;
+  size_t capacity;
+  uint64_t next_seq;
+} EventHeap;
+
+/* Vehicles of one type waiting in the event backend, oldest first. */
+typedef struct {
+  int head;
+  int tail;
+} WaitList;
+
 static const char *vehicle_path = "vehicles.txt";
+static Options g_options = {BACKEND_PROCESS, 1.0,      0,    false,
+                            1,               POLICY_ALTERNATE, "alternate",
+                            0,               {0},              NULL,
+                            DEFAULT_SAMPLE_MS, true,           false,
+                            DEFAULT_RATE,    {0},              true};
+static char g_type_letters[MAX_TYPES + 1];
+static int g_type_count;
+static uint64_t g_start_ns;
+static uint64_t g_event_now_ns;
 
 static int parse_positive_int(const char *text, const char *label, int *out);
-static int load_vehicles(const char *path, Vehicle *vehicles, int total);
+static int reader_open(VehicleReader *reader, const char *path, int limit);
+static void reader_close(VehicleReader *reader);
+static bool reader_next(VehicleReader *reader, Vehicle *out);
+static bool reader_line(VehicleReader *reader, const char **line,
+                        size_t *len);
+static bool parse_ms(const char **cursor, const char *end, uint64_t *out_ns);
+static int generate_trace(int count);
+static int parse_mix(const char *text);
+static int run_processes(Garage *garage, VehicleReader *reader);
+static int run_threads(Garage *garage, VehicleReader *reader);
+static void *vehicle_thread(void *arg);
+static int run_events(Garage *garage, VehicleReader *reader);
 static void simulate_vehicle(const Vehicle *vehicle, Garage *garage);
-static void garage_enter(Garage *garage, int type, const char *model);
-static void garage_leave(Garage *garage, int type, const char *model);
+static Garage *garage_create(int levels, int spots);
+static void garage_destroy(Garage *garage);
+static int garage_route(Garage *garage, int type, uint64_t hint);
+static int garage_enter(Garage *garage, int type, const char *model,
+                        uint64_t hint, uint64_t arrival_ns,
+                        uint64_t *parked_ns);
+static void garage_leave(Garage *garage, int level_index, int type,
+                         const char *model, uint64_t parked_ns);
+static int level_fast_enter(Level *level, int type);
+static int level_fast_leave(Level *level);
+static void level_lock(Level *level);
+static void level_unlock(Level *level);
+static bool level_try_enter(Level *level, int type);
+static void level_admit_waiter(Level *level, int type);
+static int level_release(Level *level, int *wake_type);
+static void level_wake(Level *level, int type, int count);
+static int pick_next_type(Level *level);
+static void start_phase(Level *level, int type);
+static void end_phase(Level *level);
+static void level_account(Level *level, uint64_t from, uint64_t until);
+static uint64_t garage_clock(void);
+static uint64_t occupancy_clock(void);
+static uint64_t sample_period_ns(void);
+static int phase_quota(const Level *level, int type);
+static bool quota_reached(const Level *level);
+static void level_record(Level *level, int type, uint64_t wait_ns);
+static void level_publish(Level *level);
+static void print_report(const Garage *garage);
+static int export_telemetry(const Garage *garage, const char *path);
+static void log_park(const Garage *garage, int level_index, const char *model,
+                     int type, int count);
+static void log_leave(const Garage *garage, int level_index, const char *model,
+                      int type, int count);
+static int bench_levels(int spots, int max_levels);
+static int bench_admission(int spots);
+static double bench_run(int levels, int spots, int threads,
+                        int truck_percent);
+static void *bench_worker(void *arg);
+static int type_from_letter(int letter);
+static char type_letter(int type);
+static int parse_policy(const char *text);
+static int pool_get(VehiclePool *pool);
+static void pool_put(VehiclePool *pool, int slot);
+static void wait_list_push(WaitList *list, Vehicle *vehicles, int id);
+static int wait_list_pop(WaitList *list, Vehicle *vehicles);
+static void heap_push(EventHeap *heap, uint64_t time_ns, EventType type,
+                      int vehicle_id);
+static bool heap_pop(EventHeap *heap, Event *out);
+static bool event_before(const Event *a, const Event *b);
+static uint64_t rng_next(uint64_t *state);
+static double rng_unit(uint64_t *state);
+static uint64_t now_ns(void);
+static void sleep_until_ns(uint64_t deadline_ns);
+static void garage_log(const char *fmt, ...);
+static void usage(const char *prog);
+static void futex_wait(atomic_int *word, int expected);
+static void futex_wake(atomic_int *word, int count);
 static void safe_sem_wait(sem_t *sem);
 static void safe_sem_post(sem_t *sem);
 static void safe_sem_init(sem_t *sem, unsigned int value);
 static void wait_for_children(int count);
 
 int main(int argc, char *argv[]) {
-  if (argc < 3 || argc > 4) {
-    fprintf(
-        stderr,
-        "Usage: %s <number_of_spots> <number_of_vehicles> [vehicles_file]\n",
-        argv[0]);
+  g_options.seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 16);
+  for (int type = 0; type <= MAX_TYPES; type++) {
+    g_options.weights[type] = 1;
+  }
+
+  static const struct option long_options[] = {
+      {"backend", required_argument, NULL, 'b'},
+      {"speedup", required_argument, NULL, 'x'},
+      {"seed", required_argument, NULL, 'S'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"levels", required_argument, NULL, 'L'},
+      {"policy", required_argument, NULL, 'P'},
+      {"telemetry", required_argument, NULL, 'T'},
+      {"interval", required_argument, NULL, 'I'},
+      {"virtual", no_argument, NULL, 'V'},
+      {"generate", required_argument, NULL, 'G'},
+      {"rate", required_argument, NULL, 'R'},
+      {"mix", required_argument, NULL, 'M'},
+      {"no-fast-path", no_argument, NULL, 'F'},
+      {"bench-levels", no_argument, NULL, 'B'},
+      {"bench-admission", no_argument, NULL, 'A'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int bench = 0;
+  int generate = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:x:S:qL:P:T:I:VG:R:M:",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "process") == 0) {
+        g_options.backend = BACKEND_PROCESS;
+      } else if (strcmp(optarg, "thread") == 0) {
+        g_options.backend = BACKEND_THREAD;
+      } else if (strcmp(optarg, "event") == 0) {
+        g_options.backend = BACKEND_EVENT;
+      } else {
+        fprintf(stderr, "Invalid backend: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'x': {
+      char *end = NULL;
+      g_options.speedup = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(g_options.speedup > 0.0)) {
+        fprintf(stderr, "Invalid speedup: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'S': {
+      char *end = NULL;
+      errno = 0;
+      g_options.seed = strtoull(optarg, &end, 10);
+      if (errno != 0 || end == optarg || *end != '\0') {
+        fprintf(stderr, "Invalid seed: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'q':
+      g_options.quiet = true;
+      break;
+    case 'L':
+      if (parse_positive_int(optarg, "level count", &g_options.levels) != 0) {
+        return EXIT_FAILURE;
+      }
+      if (g_options.levels > MAX_LEVELS) {
+        fprintf(stderr, "At most %d levels\n", MAX_LEVELS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'P':
+      if (parse_policy(optarg) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      g_options.telemetry_path = optarg;
+      break;
+    case 'I':
+      if (parse_positive_int(optarg, "interval", &g_options.sample_ms) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'V':
+      g_options.virtual_time = true;
+      g_options.backend = BACKEND_EVENT;
+      break;
+    case 'G':
+      if (parse_positive_int(optarg, "trace length", &generate) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'R': {
+      char *end = NULL;
+      g_options.rate = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(g_options.rate > 0.0)) {
+        fprintf(stderr, "Invalid rate: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'M':
+      if (parse_mix(optarg) != 0) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      g_options.fast_path = false;
+      break;
+    case 'B':
+    case 'A':
+      bench = opt;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  int positional = argc - optind;
+  if (generate > 0) {
+    if (positional != 0) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    return generate_trace(generate);
+  }
+  if (bench) {
+    int spots = 0;
+    if (positional != 1 ||
+        parse_positive_int(argv[optind], "number_of_spots", &spots) != 0) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (bench == 'A') {
+      return bench_admission(spots);
+    }
+    return bench_levels(spots, g_options.levels > 1 ? g_options.levels
+                                                    : BENCH_DEFAULT_LEVELS);
+  }
+  if (positional < 2 || positional > 3) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   int spots = 0;
   int total_vehicles = 0;
-  if (parse_positive_int(argv[1], "number_of_spots", &spots) != 0 ||
-      parse_positive_int(argv[2], "number_of_vehicles", &total_vehicles) != 0) {
+  if (parse_positive_int(argv[optind], "number_of_spots", &spots) != 0 ||
+      (strcmp(argv[optind + 1], "all") != 0 &&
+       parse_positive_int(argv[optind + 1], "number_of_vehicles",
+                          &total_vehicles) != 0)) {
+    return EXIT_FAILURE;
+  }
+  if (spots > SUMMARY_COUNT_MASK) {
+    fprintf(stderr, "At most %d spots per level\n", SUMMARY_COUNT_MASK);
     return EXIT_FAILURE;
   }
 
-  if (argc == 4) {
-    vehicle_path = argv[3];
+  if (positional == 3) {
+    vehicle_path = argv[optind + 2];
   }
 
-  Vehicle *vehicles = calloc((size_t)total_vehicles, sizeof(*vehicles));
-  if (!vehicles) {
-    perror("calloc vehicles");
+  VehicleReader reader;
+  if (reader_open(&reader, vehicle_path, total_vehicles) != 0) {
     return EXIT_FAILURE;
   }
 
-  if (load_vehicles(vehicle_path, vehicles, total_vehicles) != 0) {
-    free(vehicles);
-    return EXIT_FAILURE;
+  Garage *garage = garage_create(g_options.levels, spots);
+
+  if (g_options.backend == BACKEND_PROCESS) {
+    /* Each child writes its lines under the garage lock, not at exit. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
   }
 
-  Garage *garage = mmap(NULL, sizeof(*garage), PROT_READ | PROT_WRITE,
-                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-  if (garage == MAP_FAILED) {
-    perror("mmap");
-    free(vehicles);
-    return EXIT_FAILURE;
+  uint64_t start_ns = now_ns();
+  g_start_ns = start_ns;
+  int status = EXIT_SUCCESS;
+  int in_flight = 0;
+  if (g_options.backend == BACKEND_PROCESS) {
+    status = run_processes(garage, &reader);
+  } else if (g_options.backend == BACKEND_THREAD) {
+    status = run_threads(garage, &reader);
+  } else {
+    in_flight = run_events(garage, &reader);
   }
+  double elapsed_s = (double)(now_ns() - start_ns) / 1e9;
+  garage->end_ns = garage_clock();
 
-  safe_sem_init(&garage->mutex, 1);
-  safe_sem_init(&garage->car_queue, 0);
-  safe_sem_init(&garage->truck_queue, 0);
-  garage->current_type = TYPE_NONE;
-  garage->last_type = TYPE_TRUCK;
-  garage->count_inside = 0;
-  garage->spots = spots;
-  garage->waiting_cars = 0;
-  garage->waiting_trucks = 0;
+  if (reader.failed) {
+    status = EXIT_FAILURE;
+  } else if (reader.count < total_vehicles) {
+    fprintf(stderr, "Not enough valid entries in %s. Expected %d, got %d\n",
+            vehicle_path, total_vehicles, reader.count);
+    status = EXIT_FAILURE;
+  }
 
-  for (int i = 0; i < total_vehicles; i++) {
-    pid_t pid = fork();
-    if (pid < 0) {
-      perror("fork");
-      return EXIT_FAILURE;
+  if (status == EXIT_SUCCESS) {
+    printf("All vehicles have been processed. Garage simulation complete.\n");
+    printf("%d vehicles in %.3f s", reader.count, elapsed_s);
+    if (g_options.virtual_time) {
+      printf(" (%.3f s of virtual time)", (double)garage->end_ns / 1e9);
     }
-    if (pid == 0) {
-      srand((unsigned int)(time(NULL) ^ (getpid() << 16)));
-      usleep((useconds_t)(rand() % 500000));
-      simulate_vehicle(&vehicles[i], garage);
-      exit(EXIT_SUCCESS);
+    if (g_options.backend == BACKEND_EVENT) {
+      printf(", at most %d in flight", in_flight);
+    }
+    printf("\n");
+    if (reader.late > 0) {
+      printf("%d out-of-order arrivals were moved to the previous one\n",
+             reader.late);
+    }
+    print_report(garage);
+    if (g_options.telemetry_path &&
+        export_telemetry(garage, g_options.telemetry_path) != 0) {
+      status = EXIT_FAILURE;
     }
   }
 
-  wait_for_children(total_vehicles);
-
-  sem_destroy(&garage->mutex);
-  sem_destroy(&garage->car_queue);
-  sem_destroy(&garage->truck_queue);
-  munmap(garage, sizeof(*garage));
-  free(vehicles);
-
-  printf("All vehicles have been processed. Garage simulation complete.\n");
-  return EXIT_SUCCESS;
+  garage_destroy(garage);
+  reader_close(&reader);
+  return status;
 }
 
 static int parse_positive_int(const char *text, const char *label, int *out) {
@@ -135,160 +564,1566 @@ static int parse_positive_int(const char *text, const char *label, int *out) {
   return 0;
 }
 
-static int load_vehicles(const char *path, Vehicle *vehicles, int total) {
-  FILE *fp = fopen(path, "r");
-  if (!fp) {
-    perror("fopen vehicles file");
+/*
+ * Opens path ("-" for stdin) for reader_next(). A regular file is mapped
+ * whole; anything else, or a file that cannot be mapped, is read through
+ * the buffer.
+ */
+static int reader_open(VehicleReader *reader, const char *path, int limit) {
+  memset(reader, 0, sizeof(*reader));
+  reader->path = path;
+  reader->limit = limit;
+  reader->rng = g_options.seed;
+  reader->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    perror("open vehicles file");
     return -1;
   }
 
-  char line[MAX_LINE_LENGTH];
-  int count = 0;
-  while (count < total && fgets(line, sizeof(line), fp)) {
-    char type_char = '\0';
-    char model[MODEL_LEN];
-    if (sscanf(line, " %c %49s", &type_char, model) != 2) {
-      continue;
+  struct stat st;
+  if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map =
+        mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+      reader->data = map;
+      reader->size = (size_t)st.st_size;
+      reader->mapped = true;
+      reader->eof = true;
+      return 0;
     }
+  }
 
-    int type = TYPE_NONE;
-    if (type_char == 'C' || type_char == 'c') {
-      type = TYPE_CAR;
-    } else if (type_char == 'T' || type_char == 't') {
-      type = TYPE_TRUCK;
-    } else {
+  reader->data = malloc(READ_BUFFER_SIZE);
+  if (!reader->data) {
+    perror("malloc read buffer");
+    reader_close(reader);
+    return -1;
+  }
+  return 0;
+}
+
+static void reader_close(VehicleReader *reader) {
+  if (reader->mapped) {
+    munmap(reader->data, reader->size);
+  } else {
+    free(reader->data);
+  }
+  if (reader->fd != STDIN_FILENO) {
+    close(reader->fd);
+  }
+  reader->data = NULL;
+}
+
+/*
+ * Returns the next vehicle with its planned times, or false at the end of
+ * the input (or of number_of_vehicles). Lines are "TYPE MODEL" or "TYPE
+ * MODEL ARRIVAL_MS PARK_MS"; anything else is skipped.
+ *
+ * Timed arrivals must not decrease: a vehicle is admitted once the clock
+ * reaches it, so a line that goes back in time arrives with the one before
+ * it (and is counted in late). An untimed line draws its parking time as
+ * before. Its arrival comes from a sorted uniform sample below 0.5 s,
+ * drawn one order statistic at a time, so each arrival is no earlier than
+ * the last. That needs number_of_vehicles; reading "all", an untimed line
+ * arrives with the line before it.
+ */
+static bool reader_next(VehicleReader *reader, Vehicle *out) {
+  const char *line = NULL;
+  size_t len = 0;
+  while ((reader->limit == 0 || reader->count < reader->limit) &&
+         reader_line(reader, &line, &len)) {
+    const char *p = line;
+    const char *end = line + len;
+    while (p < end && isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (p == end || !isalpha((unsigned char)*p)) {
       continue;
     }
+    int letter = *p++;
+    while (p < end && isspace((unsigned char)*p)) {
+      p++;
+    }
+    const char *model = p;
+    while (p < end && !isspace((unsigned char)*p)) {
+      p++;
+    }
+    size_t model_len = (size_t)(p - model);
+    if (model_len == 0) {
+      continue;
+    }
+    uint64_t arrival_ns = 0;
+    uint64_t park_ns = 0;
+    bool timed = false;
+    while (p < end && isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (p < end) {
+      if (!parse_ms(&p, end, &arrival_ns) || !parse_ms(&p, end, &park_ns)) {
+        continue;
+      }
+      while (p < end && isspace((unsigned char)*p)) {
+        p++;
+      }
+      if (p < end) {
+        continue;
+      }
+      timed = true;
+    }
+
+    int type = type_from_letter(letter);
+    if (type == TYPE_NONE) {
+      fprintf(stderr, "More than %d vehicle types in %s\n", MAX_TYPES,
+              reader->path);
+      reader->failed = true;
+      return false;
+    }
 
-    vehicles[count].type = type;
-    strncpy(vehicles[count].model, model, sizeof(vehicles[count].model) - 1);
-    vehicles[count].model[sizeof(vehicles[count].model) - 1] = '\0';
-    count++;
+    double unit = rng_unit(&reader->rng);
+    uint64_t park_draw =
+        (MIN_PARK_S + rng_next(&reader->rng) % PARK_RANGE_S) * 1000000000ull;
+    if (reader->limit > 0) {
+      int remaining = reader->limit - reader->count;
+      reader->untimed_ns += ((double)MAX_ARRIVAL_NS - reader->untimed_ns) *
+                            (1.0 - pow(unit, 1.0 / remaining));
+    }
+    if (!timed) {
+      arrival_ns = reader->limit > 0 ? (uint64_t)reader->untimed_ns
+                                     : reader->last_arrival_ns;
+      park_ns = park_draw;
+    }
+    if (arrival_ns < reader->last_arrival_ns) {
+      arrival_ns = reader->last_arrival_ns;
+      reader->late += timed;
+    }
+    reader->last_arrival_ns = arrival_ns;
+
+    if (model_len >= sizeof(out->model)) {
+      model_len = sizeof(out->model) - 1;
+    }
+    memcpy(out->model, model, model_len);
+    out->model[model_len] = '\0';
+    out->type = type;
+    out->id = ++reader->count;
+    out->arrival_ns = (uint64_t)((double)arrival_ns / g_options.speedup);
+    out->park_ns = (uint64_t)((double)park_ns / g_options.speedup);
+    out->level = 0;
+    out->next_waiting = -1;
+    return true;
   }
+  return false;
+}
 
-  fclose(fp);
+/*
+ * Hands out the next line (without its newline), or false at the end of the
+ * input. A buffered line longer than READ_BUFFER_SIZE is cut into pieces.
+ */
+static bool reader_line(VehicleReader *reader, const char **line,
+                        size_t *len) {
+  for (;;) {
+    const char *start = reader->data + reader->pos;
+    size_t avail = reader->size - reader->pos;
+    const char *newline = memchr(start, '\n', avail);
+    if (newline || reader->eof || avail == READ_BUFFER_SIZE) {
+      if (!newline && avail == 0) {
+        return false;
+      }
+      *line = start;
+      *len = newline ? (size_t)(newline - start) : avail;
+      reader->pos += newline ? *len + 1 : *len;
+      if (reader->mapped && reader->pos - reader->released >= RELEASE_CHUNK) {
+        madvise(reader->data + reader->released, RELEASE_CHUNK,
+                MADV_DONTNEED);
+        reader->released += RELEASE_CHUNK;
+      }
+      return true;
+    }
 
-  if (count < total) {
-    fprintf(stderr, "Not enough valid entries in %s. Expected %d, got %d\n",
-            path, total, count);
-    return -1;
+    memmove(reader->data, start, avail);
+    reader->pos = 0;
+    reader->size = avail;
+    ssize_t got =
+        read(reader->fd, reader->data + avail, READ_BUFFER_SIZE - avail);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read vehicles file");
+      reader->failed = true;
+      return false;
+    }
+    if (got == 0) {
+      reader->eof = true;
+    }
+    reader->size += (size_t)got;
   }
+}
 
-  return 0;
+/*
+ * Parses one blank-separated, non-negative decimal number of milliseconds
+ * (at most nanosecond precision) at *cursor into *out_ns.
+ */
+static bool parse_ms(const char **cursor, const char *end, uint64_t *out_ns) {
+  const char *p = *cursor;
+  while (p < end && isspace((unsigned char)*p)) {
+    p++;
+  }
+  uint64_t ms = 0;
+  uint64_t fraction_ns = 0;
+  uint64_t scale = 100000;
+  bool digits = false;
+  while (p < end && isdigit((unsigned char)*p)) {
+    ms = ms * 10 + (uint64_t)(*p++ - '0');
+    digits = true;
+    if (ms > UINT64_MAX / 1000000 / 10) {
+      return false;
+    }
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && isdigit((unsigned char)*p)) {
+      fraction_ns += (uint64_t)(*p++ - '0') * scale;
+      scale /= 10;
+      digits = true;
+    }
+  }
+  if (!digits || (p < end && !isspace((unsigned char)*p))) {
+    return false;
+  }
+  *out_ns = ms * 1000000 + fraction_ns;
+  *cursor = p;
+  return true;
 }
 
-static void simulate_vehicle(const Vehicle *vehicle, Garage *garage) {
-  char type_char = (vehicle->type == TYPE_CAR) ? 'C' : 'T';
-  printf("Vehicle %s (%c) arrives. PID: %d\n", vehicle->model, type_char,
-         getpid());
+/*
+ * Writes a synthetic trace of count vehicles to stdout in the timed input
+ * format: Poisson arrivals at --rate per second, parking uniform between 1
+ * and 3 s, and types drawn in the --mix proportions. The same seed writes
+ * the same trace.
+ */
+static int generate_trace(int count) {
+  int mix_total = 0;
+  for (int type = 1; type <= g_type_count; type++) {
+    mix_total += g_options.mix[type];
+  }
+  if (mix_total == 0) {
+    parse_mix(DEFAULT_MIX);
+    for (int type = 1; type <= g_type_count; type++) {
+      mix_total += g_options.mix[type];
+    }
+  }
 
-  garage_enter(garage, vehicle->type, vehicle->model);
+  uint64_t rng = g_options.seed;
+  double arrival_ms = 0.0;
+  for (int i = 0; i < count; i++) {
+    arrival_ms += -log1p(-rng_unit(&rng)) * 1000.0 / g_options.rate;
+    double park_ms =
+        (MIN_PARK_S + rng_unit(&rng) * (PARK_RANGE_S - 1)) * 1000.0;
+    int pick = (int)(rng_next(&rng) % (uint64_t)mix_total);
+    int type = 1;
+    while (pick >= g_options.mix[type]) {
+      pick -= g_options.mix[type];
+      type++;
+    }
+    if (printf("%c Model%d %.3f %.3f\n", type_letter(type), i + 1,
+               arrival_ms, park_ms) < 0) {
+      perror("write trace");
+      return EXIT_FAILURE;
+    }
+  }
+  if (fflush(stdout) != 0) {
+    perror("write trace");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-  sleep(1 + rand() % 3);
+/*
+ * The original backend: one forked process per vehicle, forked as the
+ * vehicle arrives. Finished children are reaped along the way, so only the
+ * vehicles in flight have a process.
+ */
+static int run_processes(Garage *garage, VehicleReader *reader) {
+  uint64_t start_ns = now_ns();
+  int running = 0;
+  Vehicle vehicle;
+  while (reader_next(reader, &vehicle)) {
+    sleep_until_ns(start_ns + vehicle.arrival_ns);
+    /* Every waitpid() walks all children, so reap in batches. */
+    if (vehicle.id % REAP_BATCH == 0) {
+      while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+        running--;
+      }
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      wait_for_children(running);
+      return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      simulate_vehicle(&vehicle, garage);
+      exit(EXIT_SUCCESS);
+    }
+    running++;
+  }
 
-  garage_leave(garage, vehicle->type, vehicle->model);
+  wait_for_children(running);
+  return EXIT_SUCCESS;
 }
 
-static void garage_enter(Garage *garage, int type, const char *model) {
-  while (1) {
-    safe_sem_wait(&garage->mutex);
-    int waiting_same =
-        (type == TYPE_CAR) ? garage->waiting_cars : garage->waiting_trucks;
-    bool can_enter =
-        (garage->current_type == TYPE_NONE || garage->current_type == type) &&
-        (garage->count_inside < garage->spots) && (waiting_same == 0);
+/*
+ * One detached thread per vehicle with a small stack, started as the vehicle
+ * arrives; each posts done when it has left. The garage semaphores are the
+ * same; the kernel's thread limit (kernel.threads-max) bounds the vehicles
+ * in flight.
+ */
+static int run_threads(Garage *garage, VehicleReader *reader) {
+  sem_t done;
+  safe_sem_init(&done, 0);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  uint64_t start_ns = now_ns();
+  int started = 0;
+  int status = EXIT_SUCCESS;
+  Vehicle vehicle;
+  while (reader_next(reader, &vehicle)) {
+    sleep_until_ns(start_ns + vehicle.arrival_ns);
+    VehicleTask *task = malloc(sizeof(*task));
+    if (!task) {
+      perror("malloc task");
+      exit(EXIT_FAILURE);
+    }
+    *task = (VehicleTask){vehicle, garage, &done};
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, vehicle_thread, task);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create vehicle %d: %s\n", vehicle.id,
+              strerror(err));
+      free(task);
+      status = EXIT_FAILURE;
+      break;
+    }
+    started++;
+  }
+  pthread_attr_destroy(&attr);
 
-    if (can_enter) {
-      if (garage->current_type == TYPE_NONE) {
-        garage->current_type = type;
+  for (int i = 0; i < started; i++) {
+    safe_sem_wait(&done);
+  }
+  sem_destroy(&done);
+  return status;
+}
+
+static void *vehicle_thread(void *arg) {
+  VehicleTask *task = arg;
+  sem_t *done = task->done;
+  simulate_vehicle(&task->vehicle, task->garage);
+  free(task);
+  safe_sem_post(done);
+  return NULL;
+}
+
+/*
+ * Every vehicle is a small state machine (arriving, waiting, parked) driven
+ * by one timer loop: arrivals and departures sit in a min-heap and the loop
+ * sleeps until the earliest one is due (with --virtual it only advances the
+ * clock, so a trace replays as fast as the loop runs). A vehicle that may
+ * not park joins its level's wait list for its type; level_release() decides
+ * how many of them to wake, and those park at once in arrival order.
+ * Admission goes through the same garage_route()/level_try_enter()/
+ * level_admit_waiter()/level_release() rules as the blocking backends, so
+ * only the cost per vehicle changes.
+ */
+static int run_events(Garage *garage, VehicleReader *reader) {
+  EventHeap heap = {NULL, 0, 0, 0};
+  VehiclePool pool = {NULL, 0, -1, 0, 0};
+  size_t list_count = (size_t)garage->level_count * (MAX_TYPES + 1);
+  WaitList *waiting = malloc(list_count * sizeof(*waiting));
+  if (!waiting) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < list_count; i++) {
+    waiting[i] = (WaitList){-1, -1};
+  }
+
+  Vehicle next;
+  bool have_next = reader_next(reader, &next);
+  uint64_t start_ns = now_ns();
+  Event event;
+  for (;;) {
+    /* Read ahead only as far as the clock: arrivals come in time order. */
+    while (have_next &&
+           (heap.count == 0 || next.arrival_ns <= heap.items[0].time_ns)) {
+      int slot = pool_get(&pool);
+      pool.items[slot] = next;
+      heap_push(&heap, next.arrival_ns, EVENT_ARRIVAL, slot);
+      have_next = reader_next(reader, &next);
+    }
+    if (!heap_pop(&heap, &event)) {
+      break;
+    }
+    if (!g_options.virtual_time) {
+      sleep_until_ns(start_ns + event.time_ns);
+    }
+    g_event_now_ns = event.time_ns;
+    Vehicle *vehicles = pool.items;
+    Vehicle *vehicle = &vehicles[event.vehicle_id];
+
+    if (event.type == EVENT_ARRIVAL) {
+      garage_log("Vehicle %s (%c) arrives. ID: %d\n", vehicle->model,
+                 type_letter(vehicle->type), vehicle->id);
+      vehicle->level =
+          garage_route(garage, vehicle->type, (uint64_t)vehicle->id);
+      Level *level = &garage->levels[vehicle->level];
+      if (level_try_enter(level, vehicle->type)) {
+        level_record(level, vehicle->type, 0);
+        log_park(garage, vehicle->level, vehicle->model, vehicle->type,
+                 level->count_inside);
+        heap_push(&heap, event.time_ns + vehicle->park_ns, EVENT_DEPARTURE,
+                  event.vehicle_id);
+      } else {
+        wait_list_push(
+            &waiting[vehicle->level * (MAX_TYPES + 1) + vehicle->type],
+            vehicles, event.vehicle_id);
       }
-      garage->count_inside++;
-      printf("Vehicle %s (%c) parks. Occupancy: %d/%d\n", model,
-             (type == TYPE_CAR) ? 'C' : 'T', garage->count_inside,
-             garage->spots);
-      safe_sem_post(&garage->mutex);
-      return;
+      continue;
     }
 
-    if (type == TYPE_CAR) {
-      garage->waiting_cars++;
-      safe_sem_post(&garage->mutex);
-      safe_sem_wait(&garage->car_queue);
-      safe_sem_wait(&garage->mutex);
-      garage->waiting_cars--;
-    } else {
-      garage->waiting_trucks++;
-      safe_sem_post(&garage->mutex);
-      safe_sem_wait(&garage->truck_queue);
-      safe_sem_wait(&garage->mutex);
-      garage->waiting_trucks--;
+    Level *level = &garage->levels[vehicle->level];
+    level_account(level, event.time_ns - vehicle->park_ns, event.time_ns);
+    int wake_type = TYPE_NONE;
+    int wake = level_release(level, &wake_type);
+    log_leave(garage, vehicle->level, vehicle->model, vehicle->type,
+              level->count_inside);
+    WaitList *list = &waiting[vehicle->level * (MAX_TYPES + 1) + wake_type];
+    for (int i = 0; i < wake; i++) {
+      int woken_id = wait_list_pop(list, vehicles);
+      Vehicle *woken = &vehicles[woken_id];
+      level_admit_waiter(level, wake_type);
+      level_record(level, wake_type, event.time_ns - woken->arrival_ns);
+      log_park(garage, woken->level, woken->model, woken->type,
+               level->count_inside);
+      heap_push(&heap, event.time_ns + woken->park_ns, EVENT_DEPARTURE,
+                woken_id);
+    }
+    pool_put(&pool, event.vehicle_id);
+  }
+
+  free(heap.items);
+  free(pool.items);
+  free(waiting);
+  return pool.peak;
+}
+
+static void simulate_vehicle(const Vehicle *vehicle, Garage *garage) {
+  if (g_options.backend == BACKEND_PROCESS) {
+    garage_log("Vehicle %s (%c) arrives. PID: %d\n", vehicle->model,
+               type_letter(vehicle->type), getpid());
+  } else {
+    garage_log("Vehicle %s (%c) arrives. ID: %d\n", vehicle->model,
+               type_letter(vehicle->type), vehicle->id);
+  }
+
+  uint64_t parked_ns = 0;
+  int level = garage_enter(garage, vehicle->type, vehicle->model,
+                           (uint64_t)vehicle->id, now_ns(), &parked_ns);
+
+  sleep_until_ns(now_ns() + vehicle->park_ns);
+
+  garage_leave(garage, level, vehicle->type, vehicle->model, parked_ns);
+}
+
+static Garage *garage_create(int levels, int spots) {
+  size_t size = sizeof(Garage) + (size_t)levels * sizeof(Level);
+  Garage *garage = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (garage == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  garage->level_count = levels;
+  garage->end_ns = 0;
+  for (int i = 0; i < levels; i++) {
+    Level *level = &garage->levels[i];
+    safe_sem_init(&level->mutex, 1);
+    level->current_type = TYPE_NONE;
+    level->last_type = TYPE_NONE;
+    level->count_inside = 0;
+    level->spots = spots;
+    level->waiting_total = 0;
+    level->phase_admitted = 0;
+    level->phase_switches = 0;
+    level->phase_start_ns = 0;
+    level->phase_start_occupied_ns = 0;
+    level->locked = false;
+    atomic_init(&level->occupied_ns, 0);
+    for (int slot = 0; slot < SAMPLE_SLOTS; slot++) {
+      atomic_init(&level->occupied_slots[slot], 0);
+    }
+    atomic_init(&level->fast_admitted, 0);
+    for (int type = 0; type <= MAX_TYPES; type++) {
+      level->queues[type].waiting = 0;
+      level->queues[type].grants = 0;
+      atomic_init(&level->queues[type].wake_seq, 0);
+      memset(&level->stats[type], 0, sizeof(level->stats[type]));
+    }
+    level_publish(level);
+  }
+  return garage;
+}
+
+static void garage_destroy(Garage *garage) {
+  int levels = garage->level_count;
+  for (int i = 0; i < levels; i++) {
+    sem_destroy(&garage->levels[i].mutex);
+  }
+  munmap(garage, sizeof(Garage) + (size_t)levels * sizeof(Level));
+}
+
+/*
+ * Picks a level from the summaries alone, without taking any lock. Starting
+ * at hint (spreading arrivals over the levels), it returns the first level
+ * that would admit the vehicle right away; failing that, the level with the
+ * least traffic ahead of it: the queued vehicles of its type where the level
+ * already holds that type, else everything parked and queued there. The
+ * summaries may be stale; the level's own lock makes the final decision, so
+ * a bad guess only costs a wait, and every level keeps the one-type rule.
+ */
+static int garage_route(Garage *garage, int type, uint64_t hint) {
+  int levels = garage->level_count;
+  int start = (int)(hint % (uint64_t)levels);
+  int best = start;
+  uint64_t best_cost = UINT64_MAX;
+
+  for (int i = 0; i < levels; i++) {
+    int index = (start + i) % levels;
+    const Level *level = &garage->levels[index];
+    uint64_t summary =
+        atomic_load_explicit(&level->summary, memory_order_acquire);
+    int current = (int)(summary & 0xff);
+    uint64_t count = (summary >> SUMMARY_COUNT_SHIFT) & SUMMARY_COUNT_MASK;
+    uint64_t same = (summary >> SUMMARY_SAME_SHIFT) & SUMMARY_WAIT_MAX;
+    uint64_t other = summary >> SUMMARY_OTHER_SHIFT;
+
+    if (current == TYPE_NONE ||
+        (current == type && same == 0 && count < (uint64_t)level->spots)) {
+      return index;
+    }
+    uint64_t cost = current == type ? same : count + same + other;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = index;
+    }
+  }
+  return best;
+}
+
+/*
+ * Parks the vehicle on a level chosen by garage_route(); returns the level
+ * and stores the garage_clock() time it parked in *parked_ns. The common
+ * case goes through level_fast_enter() without the lock. Otherwise a
+ * vehicle that has to wait sleeps on its type's wake_seq and parks once it
+ * can claim a grant; which waiter of that type claims it is up to the
+ * scheduler, as it was with one semaphore per type.
+ */
+static int garage_enter(Garage *garage, int type, const char *model,
+                        uint64_t hint, uint64_t arrival_ns,
+                        uint64_t *parked_ns) {
+  int index = garage_route(garage, type, hint);
+  Level *level = &garage->levels[index];
+  int count = g_options.fast_path ? level_fast_enter(level, type) : 0;
+  if (count > 0) {
+    *parked_ns = occupancy_clock();
+    log_park(garage, index, model, type, count);
+    return index;
+  }
+
+  level_lock(level);
+  if (!level_try_enter(level, type)) {
+    TypeQueue *queue = &level->queues[type];
+    while (queue->grants == 0) {
+      int seq = atomic_load(&queue->wake_seq);
+      level_unlock(level);
+      futex_wait(&queue->wake_seq, seq);
+      level_lock(level);
+    }
+    queue->grants--;
+  }
+  level_record(level, type, now_ns() - arrival_ns);
+  *parked_ns = occupancy_clock();
+  log_park(garage, index, model, type, level->count_inside);
+  level_unlock(level);
+  return index;
+}
+
+static void garage_leave(Garage *garage, int level_index, int type,
+                         const char *model, uint64_t parked_ns) {
+  Level *level = &garage->levels[level_index];
+  level_account(level, parked_ns, occupancy_clock());
+  int remaining = g_options.fast_path ? level_fast_leave(level) : -1;
+  if (remaining >= 0) {
+    log_leave(garage, level_index, model, type, remaining);
+    return;
+  }
+
+  level_lock(level);
+  int wake_type = TYPE_NONE;
+  int wake = level_release(level, &wake_type);
+  log_leave(garage, level_index, model, type, level->count_inside);
+  if (wake > 0) {
+    level_wake(level, wake_type, wake);
+  }
+  level_unlock(level);
+}
+
+/*
+ * Parks a vehicle with one compare-and-swap on the summary when the level
+ * already holds its type, has a free spot, nobody is queued and the lock is
+ * free: the admission rule then has nothing else to check, since quotas
+ * only apply while another type waits. Returns the new occupancy, or 0 to
+ * take the locked path.
+ */
+static int level_fast_enter(Level *level, int type) {
+  uint64_t summary = atomic_load(&level->summary);
+  for (;;) {
+    int count = (int)((summary >> SUMMARY_COUNT_SHIFT) & SUMMARY_COUNT_MASK);
+    if ((summary & SUMMARY_SLOW_MASK) != 0 || (int)(summary & 0xff) != type ||
+        count >= level->spots) {
+      return 0;
     }
+    if (atomic_compare_exchange_weak(&level->summary, &summary,
+                                     summary + (1ull << SUMMARY_COUNT_SHIFT))) {
+      atomic_fetch_add(&level->fast_admitted, 1);
+      return count + 1;
+    }
+  }
+}
 
-    if (garage->current_type == TYPE_NONE) {
-      garage->current_type = type;
+/*
+ * Frees a spot with one compare-and-swap when nobody is queued, the lock is
+ * free and the vehicle is not the last one: nobody needs waking and no
+ * phase ends. Returns the vehicles left, or -1 to take the locked path.
+ */
+static int level_fast_leave(Level *level) {
+  uint64_t summary = atomic_load(&level->summary);
+  for (;;) {
+    int count = (int)((summary >> SUMMARY_COUNT_SHIFT) & SUMMARY_COUNT_MASK);
+    if ((summary & SUMMARY_SLOW_MASK) != 0 || count <= 1) {
+      return -1;
     }
-    garage->count_inside++;
-    printf("Vehicle %s (%c) parks. Occupancy: %d/%d\n", model,
-           (type == TYPE_CAR) ? 'C' : 'T', garage->count_inside, garage->spots);
-    safe_sem_post(&garage->mutex);
+    if (atomic_compare_exchange_weak(&level->summary, &summary,
+                                     summary - (1ull << SUMMARY_COUNT_SHIFT))) {
+      return count - 1;
+    }
+  }
+}
+
+/*
+ * Takes the level lock and closes the fast path: with SUMMARY_LOCKED set
+ * every compare-and-swap fails, so the summary only changes under the lock
+ * until level_unlock(). The occupancy the fast path left there is read back,
+ * and its admissions are added to the current phase and type with no wait.
+ * A fast admission whose count lands late is still folded into its own
+ * phase, which cannot end before that vehicle has left.
+ */
+static void level_lock(Level *level) {
+  safe_sem_wait(&level->mutex);
+  uint64_t summary = atomic_fetch_or(&level->summary, SUMMARY_LOCKED);
+  level->count_inside =
+      (int)((summary >> SUMMARY_COUNT_SHIFT) & SUMMARY_COUNT_MASK);
+  uint64_t fast = atomic_exchange(&level->fast_admitted, 0);
+  if (fast > 0) {
+    TypeStats *stats = &level->stats[level->current_type];
+    stats->parked += fast;
+    stats->wait_hist[0] += fast;
+    level->phase_admitted += (int)fast;
+  }
+  level->locked = true;
+}
+
+/* Republishes the summary without SUMMARY_LOCKED and drops the lock. */
+static void level_unlock(Level *level) {
+  level->locked = false;
+  level_publish(level);
+  safe_sem_post(&level->mutex);
+}
+
+/*
+ * The admission rule, shared by all backends; callers hold the level lock
+ * (the event backend is single-threaded). Parks the vehicle if the level is
+ * empty or holds its type, has a free spot, no vehicle of that type is
+ * already queued and the phase has not used up its quota; otherwise counts
+ * it as waiting and returns false.
+ */
+static bool level_try_enter(Level *level, int type) {
+  TypeQueue *queue = &level->queues[type];
+  bool can_enter =
+      (level->current_type == TYPE_NONE || level->current_type == type) &&
+      (level->count_inside < level->spots) && (queue->waiting == 0) &&
+      !quota_reached(level);
+
+  if (!can_enter) {
+    queue->waiting++;
+    level->waiting_total++;
+    level_publish(level);
+    return false;
+  }
+  if (level->current_type == TYPE_NONE) {
+    start_phase(level, type);
+  }
+  level->count_inside++;
+  level->phase_admitted++;
+  level_publish(level);
+  return true;
+}
+
+/*
+ * Parks a waiter that level_release() chose to wake. The releasing side
+ * calls this before waking it, so the spot is taken under the same lock: a
+ * woken vehicle can no longer find the level switched to another type by
+ * the time it runs.
+ */
+static void level_admit_waiter(Level *level, int type) {
+  level->queues[type].waiting--;
+  level->waiting_total--;
+  if (level->current_type == TYPE_NONE) {
+    start_phase(level, type);
+  }
+  level->count_inside++;
+  level->phase_admitted++;
+  level_publish(level);
+}
+
+/*
+ * Frees one spot. When the level empties, the policy picks the next type
+ * among those waiting (pick_next_type()) and up to `spots` of it are woken,
+ * or fewer if the phase quota is smaller; otherwise one waiter of the
+ * current type takes the freed spot unless the quota holds it back. Returns
+ * the number to wake and stores their type in *wake_type.
+ */
+static int level_release(Level *level, int *wake_type) {
+  level->count_inside--;
+  int wake = 0;
+
+  if (level->count_inside == 0) {
+    end_phase(level);
+    level->current_type = TYPE_NONE;
+    if (level->waiting_total > 0) {
+      int next_type = pick_next_type(level);
+      start_phase(level, next_type);
+
+      int limit = level->spots;
+      int quota = phase_quota(level, next_type);
+      if (quota < limit) {
+        limit = quota;
+      }
+      int waiting = level->queues[next_type].waiting;
+      *wake_type = next_type;
+      wake = limit < waiting ? limit : waiting;
+    }
+  } else if (level->queues[level->current_type].waiting > 0 &&
+             level->count_inside < level->spots && !quota_reached(level)) {
+    *wake_type = level->current_type;
+    wake = 1;
+  }
+
+  level_publish(level);
+  return wake;
+}
+
+/*
+ * Parks `count` waiters of `type` and wakes them with a single FUTEX_WAKE,
+ * however large the batch; called under level->mutex.
+ */
+static void level_wake(Level *level, int type, int count) {
+  TypeQueue *queue = &level->queues[type];
+  for (int i = 0; i < count; i++) {
+    level_admit_waiter(level, type);
+  }
+  queue->grants += count;
+  atomic_fetch_add(&queue->wake_seq, 1);
+  futex_wake(&queue->wake_seq, count);
+}
+
+/*
+ * Chooses which waiting type gets an emptied level: the next one round-robin
+ * after last_type, or under the largest policy the longest queue (ties in
+ * round-robin order).
+ */
+static int pick_next_type(Level *level) {
+  int best = TYPE_NONE;
+  for (int i = 1; i <= g_type_count; i++) {
+    int type = (level->last_type + i - 1) % g_type_count + 1;
+    int waiting = level->queues[type].waiting;
+    if (waiting == 0) {
+      continue;
+    }
+    if (g_options.policy != POLICY_LARGEST) {
+      return type;
+    }
+    if (best == TYPE_NONE || waiting > level->queues[best].waiting) {
+      best = type;
+    }
+  }
+  return best;
+}
+
+/* Hands the level to `type`; a change of type counts as a phase switch. */
+static void start_phase(Level *level, int type) {
+  if (level->last_type != TYPE_NONE && level->last_type != type) {
+    level->phase_switches++;
+  }
+  level->current_type = type;
+  level->last_type = type;
+  level->phase_admitted = 0;
+  level->phase_start_ns = occupancy_clock();
+  level->phase_start_occupied_ns = atomic_load(&level->occupied_ns);
+}
+
+/*
+ * Closes the current phase once its last vehicle has left. Every vehicle of
+ * the phase has accounted its stay by then, so used is the phase's share of
+ * occupied_ns.
+ */
+static void end_phase(Level *level) {
+  TypeStats *stats = &level->stats[level->current_type];
+  uint64_t length = occupancy_clock() - level->phase_start_ns;
+  uint64_t used =
+      atomic_load(&level->occupied_ns) - level->phase_start_occupied_ns;
+  stats->phases++;
+  stats->phase_sum_ns += length;
+  if (length > stats->phase_max_ns) {
+    stats->phase_max_ns = length;
+  }
+  stats->idle_spot_ns += (uint64_t)level->spots * length - used;
+}
+
+/*
+ * Adds a departing vehicle's stay [from, until) to the level's occupancy
+ * integral and its sample slots. Departures call this before giving up the
+ * spot, on the fast path too, so the adds are atomic; by the time a level
+ * empties, its integral covers every vehicle that used it. Time past the
+ * last slot is folded into it, so long runs need a longer --interval. The
+ * admission benchmark turns this off to time admission alone.
+ */
+static void level_account(Level *level, uint64_t from, uint64_t until) {
+  if (!g_options.track_occupancy || until <= from) {
     return;
   }
+  atomic_fetch_add_explicit(&level->occupied_ns, until - from,
+                            memory_order_relaxed);
+  uint64_t sample_ns = sample_period_ns();
+  while (from < until) {
+    uint64_t slot = from / sample_ns;
+    uint64_t end = (slot + 1) * sample_ns;
+    if (slot >= SAMPLE_SLOTS - 1) {
+      slot = SAMPLE_SLOTS - 1;
+      end = until;
+    } else if (end > until) {
+      end = until;
+    }
+    atomic_fetch_add_explicit(&level->occupied_slots[slot], end - from,
+                              memory_order_relaxed);
+    from = end;
+  }
 }
 
-static void garage_leave(Garage *garage, int type, const char *model) {
-  safe_sem_wait(&garage->mutex);
-  garage->count_inside--;
-  printf("Vehicle %s (%c) leaves. Remaining: %d\n", model,
-         (type == TYPE_CAR) ? 'C' : 'T', garage->count_inside);
+/*
+ * Time since the run started: the virtual clock of the event loop, or the
+ * monotonic clock for the blocking backends (which every process reads
+ * consistently).
+ */
+static uint64_t garage_clock(void) {
+  if (g_options.backend == BACKEND_EVENT) {
+    return g_event_now_ns;
+  }
+  uint64_t now = now_ns();
+  return now > g_start_ns ? now - g_start_ns : 0;
+}
 
-  if (garage->count_inside == 0) {
-    garage->current_type = TYPE_NONE;
+/*
+ * garage_clock() while occupancy is tracked, otherwise 0: the admission
+ * benchmark would spend more time reading the clock than admitting.
+ */
+static uint64_t occupancy_clock(void) {
+  return g_options.track_occupancy ? garage_clock() : 0;
+}
 
-    int cars_waiting = garage->waiting_cars;
-    int trucks_waiting = garage->waiting_trucks;
+/* --interval is schedule time, so --speedup divides it like everything else. */
+static uint64_t sample_period_ns(void) {
+  uint64_t period =
+      (uint64_t)((double)g_options.sample_ms * 1e6 / g_options.speedup);
+  return period > 0 ? period : 1;
+}
 
-    if (cars_waiting > 0 || trucks_waiting > 0) {
-      int next_type = TYPE_NONE;
-      if (cars_waiting > 0 && trucks_waiting > 0) {
-        next_type = (garage->last_type == TYPE_CAR) ? TYPE_TRUCK : TYPE_CAR;
-      } else if (cars_waiting > 0) {
-        next_type = TYPE_CAR;
-      } else {
-        next_type = TYPE_TRUCK;
+/*
+ * How many vehicles a phase of `type` may admit while other types wait:
+ * the quota (default: the level's spots), or for the weighted policy the
+ * type's weight times the spots. Unlimited for the other policies.
+ */
+static int phase_quota(const Level *level, int type) {
+  if (g_options.policy == POLICY_QUOTA) {
+    return g_options.quota > 0 ? g_options.quota : level->spots;
+  }
+  if (g_options.policy == POLICY_WEIGHTED) {
+    int64_t quota = (int64_t)g_options.weights[type] * level->spots;
+    return quota < INT_MAX ? (int)quota : INT_MAX;
+  }
+  return INT_MAX;
+}
+
+/*
+ * A phase that has used up its quota stops admitting while another type is
+ * waiting; the level then drains and switches.
+ */
+static bool quota_reached(const Level *level) {
+  if (level->current_type == TYPE_NONE) {
+    return false;
+  }
+  int others =
+      level->waiting_total - level->queues[level->current_type].waiting;
+  return others > 0 &&
+         level->phase_admitted >= phase_quota(level, level->current_type);
+}
+
+/* Adds one admission and its wait to the level's per-type totals. */
+static void level_record(Level *level, int type, uint64_t wait_ns) {
+  TypeStats *stats = &level->stats[type];
+  stats->parked++;
+  stats->wait_sum_ns += wait_ns;
+  if (wait_ns > stats->wait_max_ns) {
+    stats->wait_max_ns = wait_ns;
+  }
+  uint64_t wait_us = wait_ns / 1000;
+  int bucket = wait_us == 0 ? 0 : 64 - __builtin_clzll(wait_us);
+  stats->wait_hist[bucket < WAIT_BUCKETS ? bucket : WAIT_BUCKETS - 1]++;
+}
+
+/*
+ * Refreshes the summary; called under the level lock after every change.
+ * Layout: current_type in bits 0-7, count_inside in 8-30, SUMMARY_LOCKED
+ * (bit 31) while the lock is held, then the waiting counts of the current
+ * type and of all other types (16 bits each, saturated).
+ */
+static void level_publish(Level *level) {
+  int same = level->current_type == TYPE_NONE
+                 ? 0
+                 : level->queues[level->current_type].waiting;
+  int other = level->waiting_total - same;
+  uint64_t summary =
+      (uint64_t)level->current_type |
+      ((uint64_t)level->count_inside << SUMMARY_COUNT_SHIFT) |
+      (level->locked ? SUMMARY_LOCKED : 0) |
+      ((uint64_t)(same < SUMMARY_WAIT_MAX ? same : SUMMARY_WAIT_MAX)
+       << SUMMARY_SAME_SHIFT) |
+      ((uint64_t)(other < SUMMARY_WAIT_MAX ? other : SUMMARY_WAIT_MAX)
+       << SUMMARY_OTHER_SHIFT);
+  atomic_store_explicit(&level->summary, summary, memory_order_release);
+}
+
+/*
+ * count is the occupancy right after the change. Fast-path vehicles log
+ * after their compare-and-swap without any lock, so their lines may land a
+ * little out of order with those of other vehicles.
+ */
+static void log_park(const Garage *garage, int level_index, const char *model,
+                     int type, int count) {
+  const Level *level = &garage->levels[level_index];
+  if (garage->level_count == 1) {
+    garage_log("Vehicle %s (%c) parks. Occupancy: %d/%d\n", model,
+               type_letter(type), count, level->spots);
+  } else {
+    garage_log("Vehicle %s (%c) parks on level %d. Occupancy: %d/%d\n", model,
+               type_letter(type), level_index, count, level->spots);
+  }
+}
+
+static void log_leave(const Garage *garage, int level_index, const char *model,
+                      int type, int count) {
+  if (garage->level_count == 1) {
+    garage_log("Vehicle %s (%c) leaves. Remaining: %d\n", model,
+               type_letter(type), count);
+  } else {
+    garage_log("Vehicle %s (%c) leaves level %d. Remaining: %d\n", model,
+               type_letter(type), level_index, count);
+  }
+}
+
+/*
+ * Per-type totals over all levels, printed after the run. Throughput is
+ * over garage_clock() time, so virtual runs report their schedule's rate.
+ */
+static void print_report(const Garage *garage) {
+  uint64_t switches = 0;
+  uint64_t parked_total = 0;
+  double occupied = 0.0;
+  double capacity = 0.0;
+  for (int i = 0; i < garage->level_count; i++) {
+    const Level *level = &garage->levels[i];
+    switches += level->phase_switches;
+    occupied += (double)level->occupied_ns;
+    capacity += (double)level->spots * (double)garage->end_ns;
+  }
+  printf("policy %s, %llu phase switches, utilisation %.1f%%\n",
+         g_options.policy_spec, (unsigned long long)switches,
+         capacity > 0.0 ? 100.0 * occupied / capacity : 0.0);
+  printf("%4s %10s %14s %14s\n", "type", "parked", "mean wait ms",
+         "max wait ms");
+  for (int type = 1; type <= g_type_count; type++) {
+    TypeStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < garage->level_count; i++) {
+      const TypeStats *stats = &garage->levels[i].stats[type];
+      total.parked += stats->parked;
+      total.wait_sum_ns += stats->wait_sum_ns;
+      if (stats->wait_max_ns > total.wait_max_ns) {
+        total.wait_max_ns = stats->wait_max_ns;
       }
+    }
+    double mean_ms =
+        total.parked ? (double)total.wait_sum_ns / (double)total.parked / 1e6
+                     : 0.0;
+    printf("%4c %10llu %14.1f %14.1f\n", type_letter(type),
+           (unsigned long long)total.parked, mean_ms,
+           (double)total.wait_max_ns / 1e6);
+    parked_total += total.parked;
+  }
+  double elapsed_s = (double)garage->end_ns / 1e9;
+  printf("throughput %.1f vehicles/s\n",
+         elapsed_s > 0.0 ? (double)parked_total / elapsed_s : 0.0);
+}
 
-      garage->current_type = next_type;
-      garage->last_type = next_type;
+/*
+ * Writes the telemetry of every level to path: JSON when the name ends in
+ * ".json", otherwise CSV in long form (one metric,level,type,key,value row
+ * per number) that loads straight into a spreadsheet or data frame.
+ */
+static int export_telemetry(const Garage *garage, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen telemetry file");
+    return -1;
+  }
 
-      int slots = garage->spots;
-      if (next_type == TYPE_CAR) {
-        if (slots > cars_waiting) {
-          slots = cars_waiting;
-        }
-        for (int i = 0; i < slots; i++) {
-          safe_sem_post(&garage->car_queue);
-        }
+  size_t len = strlen(path);
+  bool json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+  uint64_t sample_ns = sample_period_ns();
+  uint64_t slots = (garage->end_ns + sample_ns - 1) / sample_ns;
+  if (slots > SAMPLE_SLOTS) {
+    slots = SAMPLE_SLOTS;
+  }
+  double sample_ms = (double)sample_ns / 1e6;
+
+  if (json) {
+    fprintf(fp,
+            "{\"policy\": \"%s\", \"schedule_ms\": %.3f, "
+            "\"sample_ms\": %.3f, \"levels\": [",
+            g_options.policy_spec, (double)garage->end_ns / 1e6, sample_ms);
+  } else {
+    fprintf(fp, "metric,level,type,key,value\n");
+  }
+
+  for (int i = 0; i < garage->level_count; i++) {
+    const Level *level = &garage->levels[i];
+    double capacity_ns = (double)level->spots * (double)sample_ns;
+    if (json) {
+      fprintf(fp,
+              "%s\n  {\"level\": %d, \"spots\": %d, \"phase_switches\": %llu,"
+              "\n   \"utilisation\": [",
+              i ? "," : "", i, level->spots,
+              (unsigned long long)level->phase_switches);
+    } else {
+      fprintf(fp, "phase_switches,%d,,,%llu\n", i,
+              (unsigned long long)level->phase_switches);
+    }
+    for (uint64_t slot = 0; slot < slots; slot++) {
+      double used = (double)level->occupied_slots[slot] / capacity_ns;
+      if (json) {
+        fprintf(fp, "%s%.4f", slot ? ", " : "", used);
       } else {
-        if (slots > trucks_waiting) {
-          slots = trucks_waiting;
+        fprintf(fp, "utilisation,%d,,%.3f,%.4f\n", i,
+                (double)slot * sample_ms, used);
+      }
+    }
+    if (json) {
+      fprintf(fp, "],\n   \"types\": {");
+    }
+
+    for (int type = 1; type <= g_type_count; type++) {
+      const TypeStats *stats = &level->stats[type];
+      char letter = type_letter(type);
+      double mean_wait_ms =
+          stats->parked
+              ? (double)stats->wait_sum_ns / (double)stats->parked / 1e6
+              : 0.0;
+      double mean_phase_ms =
+          stats->phases
+              ? (double)stats->phase_sum_ns / (double)stats->phases / 1e6
+              : 0.0;
+      double idle_spots = stats->phase_sum_ns ? (double)stats->idle_spot_ns /
+                                                    (double)stats->phase_sum_ns
+                                              : 0.0;
+      if (json) {
+        fprintf(fp,
+                "%s\n    \"%c\": {\"parked\": %llu, \"mean_wait_ms\": %.3f, "
+                "\"max_wait_ms\": %.3f, \"phases\": %llu, "
+                "\"mean_phase_ms\": %.3f, \"max_phase_ms\": %.3f, "
+                "\"mean_idle_spots\": %.3f,\n     \"wait_hist_us\": [",
+                type > 1 ? "," : "", letter,
+                (unsigned long long)stats->parked, mean_wait_ms,
+                (double)stats->wait_max_ns / 1e6,
+                (unsigned long long)stats->phases, mean_phase_ms,
+                (double)stats->phase_max_ns / 1e6, idle_spots);
+      } else {
+        fprintf(fp, "parked,%d,%c,,%llu\n", i, letter,
+                (unsigned long long)stats->parked);
+        fprintf(fp, "mean_wait_ms,%d,%c,,%.3f\n", i, letter, mean_wait_ms);
+        fprintf(fp, "max_wait_ms,%d,%c,,%.3f\n", i, letter,
+                (double)stats->wait_max_ns / 1e6);
+        fprintf(fp, "phases,%d,%c,,%llu\n", i, letter,
+                (unsigned long long)stats->phases);
+        fprintf(fp, "mean_phase_ms,%d,%c,,%.3f\n", i, letter, mean_phase_ms);
+        fprintf(fp, "max_phase_ms,%d,%c,,%.3f\n", i, letter,
+                (double)stats->phase_max_ns / 1e6);
+        fprintf(fp, "mean_idle_spots,%d,%c,,%.3f\n", i, letter, idle_spots);
+      }
+
+      bool first = true;
+      for (int bucket = 0; bucket < WAIT_BUCKETS; bucket++) {
+        if (stats->wait_hist[bucket] == 0) {
+          continue;
         }
-        for (int i = 0; i < slots; i++) {
-          safe_sem_post(&garage->truck_queue);
+        unsigned long long upper_us = 1ull << bucket;
+        unsigned long long count =
+            (unsigned long long)stats->wait_hist[bucket];
+        if (json) {
+          fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ", upper_us, count);
+        } else {
+          fprintf(fp, "wait_hist_us,%d,%c,%llu,%llu\n", i, letter, upper_us,
+                  count);
         }
+        first = false;
+      }
+      if (json) {
+        fprintf(fp, "]}");
       }
     }
+    if (json) {
+      fprintf(fp, "}}");
+    }
+  }
+  if (json) {
+    fprintf(fp, "\n]}\n");
+  }
+
+  if (fclose(fp) != 0) {
+    perror("write telemetry file");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Vehicle types are letters ('C' car, 'T' truck, 'M' motorcycle, ...),
+ * numbered 1..g_type_count in order of first appearance. Returns TYPE_NONE
+ * once MAX_TYPES are taken.
+ */
+static int type_from_letter(int letter) {
+  letter = toupper(letter);
+  for (int type = 1; type <= g_type_count; type++) {
+    if (g_type_letters[type] == letter) {
+      return type;
+    }
+  }
+  if (g_type_count == MAX_TYPES) {
+    return TYPE_NONE;
+  }
+  g_type_letters[++g_type_count] = (char)letter;
+  return g_type_count;
+}
+
+static char type_letter(int type) {
+  return g_type_letters[type];
+}
+
+/*
+ * Accepted forms:
+ *   alternate            round-robin over the waiting types (default)
+ *   largest              the type with the most vehicles queued
+ *   quota[:N]            round-robin, but a phase admits at most N vehicles
+ *                        (default: one level's spots) while others wait
+ *   weighted:L=W,...     round-robin where a phase of each type admits at
+ *                        most weight * spots vehicles while others wait,
+ *                        e.g. weighted:C=3,T=1; unlisted types weigh 1
+ */
+static int parse_policy(const char *text) {
+  g_options.policy_spec = text;
+  if (strcmp(text, "alternate") == 0) {
+    g_options.policy = POLICY_ALTERNATE;
+    return 0;
+  }
+  if (strcmp(text, "largest") == 0) {
+    g_options.policy = POLICY_LARGEST;
+    return 0;
+  }
+  if (strncmp(text, "quota", 5) == 0 && (text[5] == '\0' || text[5] == ':')) {
+    g_options.policy = POLICY_QUOTA;
+    g_options.quota = 0;
+    if (text[5] == ':' &&
+        parse_positive_int(text + 6, "quota", &g_options.quota) != 0) {
+      return -1;
+    }
+    return 0;
+  }
+  if (strncmp(text, "weighted:", 9) == 0) {
+    g_options.policy = POLICY_WEIGHTED;
+    const char *p = text + 9;
+    while (*p != '\0') {
+      char *end = NULL;
+      if (!isalpha((unsigned char)p[0]) || p[1] != '=') {
+        break;
+      }
+      int type = type_from_letter(p[0]);
+      long weight = strtol(p + 2, &end, 10);
+      if (type == TYPE_NONE || end == p + 2 || weight <= 0 ||
+          weight > INT_MAX || (*end != ',' && *end != '\0')) {
+        break;
+      }
+      g_options.weights[type] = (int)weight;
+      p = *end == ',' ? end + 1 : end;
+    }
+    if (*p == '\0') {
+      return 0;
+    }
+  }
+  fprintf(stderr, "Invalid policy: %s\n", text);
+  return -1;
+}
+
+/* --mix C=7,T=3,...: relative weights of the types --generate draws. */
+static int parse_mix(const char *text) {
+  memset(g_options.mix, 0, sizeof(g_options.mix));
+  const char *p = text;
+  while (*p != '\0') {
+    char *end = NULL;
+    if (!isalpha((unsigned char)p[0]) || p[1] != '=') {
+      break;
+    }
+    int type = type_from_letter(p[0]);
+    long weight = strtol(p + 2, &end, 10);
+    if (type == TYPE_NONE || end == p + 2 || weight <= 0 ||
+        weight > INT_MAX / MAX_TYPES || (*end != ',' && *end != '\0')) {
+      break;
+    }
+    g_options.mix[type] = (int)weight;
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (*p == '\0' && p != text) {
+    return 0;
+  }
+  fprintf(stderr, "Invalid mix: %s\n", text);
+  return -1;
+}
+
+static int pool_get(VehiclePool *pool) {
+  if (pool->free_head == -1) {
+    int capacity = pool->capacity ? pool->capacity * 2 : 1024;
+    Vehicle *items = realloc(pool->items, (size_t)capacity * sizeof(*items));
+    if (!items) {
+      perror("realloc vehicles");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = capacity - 1; i >= pool->capacity; i--) {
+      items[i].next_waiting = pool->free_head;
+      pool->free_head = i;
+    }
+    pool->items = items;
+    pool->capacity = capacity;
+  }
+  int slot = pool->free_head;
+  pool->free_head = pool->items[slot].next_waiting;
+  if (++pool->in_use > pool->peak) {
+    pool->peak = pool->in_use;
+  }
+  return slot;
+}
+
+static void pool_put(VehiclePool *pool, int slot) {
+  pool->items[slot].next_waiting = pool->free_head;
+  pool->free_head = slot;
+  pool->in_use--;
+}
+
+static void wait_list_push(WaitList *list, Vehicle *vehicles, int id) {
+  vehicles[id].next_waiting = -1;
+  if (list->tail == -1) {
+    list->head = id;
   } else {
-    if (garage->current_type == TYPE_CAR && garage->waiting_cars > 0 &&
-        garage->count_inside < garage->spots) {
-      safe_sem_post(&garage->car_queue);
-    } else if (garage->current_type == TYPE_TRUCK &&
-               garage->waiting_trucks > 0 &&
-               garage->count_inside < garage->spots) {
-      safe_sem_post(&garage->truck_queue);
+    vehicles[list->tail].next_waiting = id;
+  }
+  list->tail = id;
+}
+
+static int wait_list_pop(WaitList *list, Vehicle *vehicles) {
+  int id = list->head;
+  list->head = vehicles[id].next_waiting;
+  if (list->head == -1) {
+    list->tail = -1;
+  }
+  return id;
+}
+
+/*
+ * Admission benchmark: BENCH_THREADS threads park and leave at once (no
+ * parking time, 70% cars) for BENCH_DURATION_NS on 1, 2, 4, ... levels of
+ * `spots` each, and report admissions per second.
+ */
+static int bench_levels(int spots, int max_levels) {
+  printf("%6s %16s %10s\n", "levels", "admissions/s", "speedup");
+  double base = 0.0;
+  for (int levels = 1; levels <= max_levels; levels *= 2) {
+    double rate = bench_run(levels, spots, BENCH_THREADS, 30);
+    if (levels == 1) {
+      base = rate;
     }
+    printf("%6d %16.0f %9.2fx\n", levels, rate, rate / base);
   }
+  return EXIT_SUCCESS;
+}
 
-  safe_sem_post(&garage->mutex);
+/*
+ * Fast path benchmark: 1, 2, 4, ... BENCH_THREADS threads park and leave
+ * cars only on one level of `spots`, once through the lock alone and once
+ * with the compare-and-swap fast path, and report admissions per second.
+ */
+static int bench_admission(int spots) {
+  printf("%7s %14s %14s %10s\n", "threads", "locked/s", "cas/s", "speedup");
+  for (int threads = 1; threads <= BENCH_THREADS; threads *= 2) {
+    g_options.fast_path = false;
+    double locked = bench_run(1, spots, threads, 0);
+    g_options.fast_path = true;
+    double cas = bench_run(1, spots, threads, 0);
+    printf("%7d %14.0f %14.0f %9.2fx\n", threads, locked, cas, cas / locked);
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Runs `threads` bench_worker()s on a fresh garage for BENCH_DURATION_NS and
+ * returns admissions per second; truck_percent of the arrivals are trucks.
+ */
+static double bench_run(int levels, int spots, int threads,
+                        int truck_percent) {
+  g_options.backend = BACKEND_THREAD;
+  g_options.quiet = true;
+  g_options.track_occupancy = false;
+  type_from_letter('C');
+  type_from_letter('T');
+
+  Garage *garage = garage_create(levels, spots);
+  atomic_bool stop = false;
+  pthread_t handles[BENCH_THREADS];
+  BenchWorker workers[BENCH_THREADS];
+
+  uint64_t start_ns = now_ns();
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (BenchWorker){garage, &stop, g_options.seed + (uint64_t)i,
+                               truck_percent, 0};
+    int err = pthread_create(&handles[i], NULL, bench_worker, &workers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+  sleep_until_ns(start_ns + BENCH_DURATION_NS);
+  atomic_store(&stop, true);
+
+  uint64_t admissions = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(handles[i], NULL);
+    admissions += workers[i].admissions;
+  }
+  double rate = (double)admissions / ((double)(now_ns() - start_ns) / 1e9);
+  garage_destroy(garage);
+  return rate;
+}
+
+static void *bench_worker(void *arg) {
+  BenchWorker *worker = arg;
+  uint64_t rng = worker->seed;
+  while (!atomic_load_explicit(worker->stop, memory_order_relaxed)) {
+    uint64_t draw = rng_next(&rng);
+    bool truck = (int)(draw % 100) < worker->truck_percent;
+    int type = type_from_letter(truck ? 'T' : 'C');
+    uint64_t parked_ns = 0;
+    int level = garage_enter(worker->garage, type, "bench", draw >> 8,
+                             now_ns(), &parked_ns);
+    garage_leave(worker->garage, level, type, "bench", parked_ns);
+    worker->admissions++;
+  }
+  return NULL;
+}
+
+static void heap_push(EventHeap *heap, uint64_t time_ns, EventType type,
+                      int vehicle_id) {
+  if (heap->count == heap->capacity) {
+    size_t capacity = heap->capacity ? heap->capacity * 2 : 16;
+    Event *items = realloc(heap->items, capacity * sizeof(*items));
+    if (!items) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    heap->items = items;
+    heap->capacity = capacity;
+  }
+
+  Event event = {time_ns, heap->next_seq++, type, vehicle_id};
+  size_t i = heap->count++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!event_before(&event, &heap->items[parent])) {
+      break;
+    }
+    heap->items[i] = heap->items[parent];
+    i = parent;
+  }
+  heap->items[i] = event;
+}
+
+static bool heap_pop(EventHeap *heap, Event *out) {
+  if (heap->count == 0) {
+    return false;
+  }
+
+  *out = heap->items[0];
+  Event last = heap->items[--heap->count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= heap->count) {
+      break;
+    }
+    if (child + 1 < heap->count &&
+        event_before(&heap->items[child + 1], &heap->items[child])) {
+      child++;
+    }
+    if (!event_before(&heap->items[child], &last)) {
+      break;
+    }
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return true;
+}
+
+static bool event_before(const Event *a, const Event *b) {
+  if (a->time_ns != b->time_ns) {
+    return a->time_ns < b->time_ns;
+  }
+  return a->seq < b->seq;
+}
+
+/* splitmix64: tiny, seedable and identical in every process. */
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) from the top 53 bits. */
+static double rng_unit(uint64_t *state) {
+  return (double)(rng_next(state) >> 11) / 9007199254740992.0;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline_ns) {
+  struct timespec ts = {(time_t)(deadline_ns / 1000000000ull),
+                        (long)(deadline_ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static void garage_log(const char *fmt, ...) {
+  if (g_options.quiet) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <number_of_spots> <number_of_vehicles|all> "
+          "[vehicles_file|-]\n"
+          "       %s --bench-levels [-L N] <number_of_spots>\n"
+          "       %s --bench-admission <number_of_spots>\n"
+          "       %s --generate N [-S SEED] [-R RATE] [-M MIX] > trace.txt\n"
+          "  -b, --backend KIND   process (fork per vehicle, default), "
+          "thread or event\n"
+          "  -x, --speedup F      divide arrival and parking times by F\n"
+          "  -S, --seed N         seed for arrival and parking times\n"
+          "  -V, --virtual        event backend on a virtual clock: replay "
+          "without sleeping\n"
+          "  -G, --generate N     write a synthetic N-vehicle trace to stdout "
+          "and exit\n"
+          "  -R, --rate R         trace arrivals per second (Poisson, "
+          "default 100)\n"
+          "  -M, --mix SPEC       trace type weights, e.g. C=6,T=2,M=1 "
+          "(default C=7,T=3)\n"
+          "  -T, --telemetry PATH write telemetry to PATH at exit (CSV, or "
+          "JSON for *.json)\n"
+          "  -I, --interval MS    utilisation sample period in schedule ms "
+          "(default 100)\n"
+          "  -L, --levels N       split the garage into N levels of "
+          "number_of_spots each\n"
+          "  -P, --policy SPEC    next type on an emptied level: alternate "
+          "(default),\n"
+          "                       largest, quota[:N] or weighted:C=3,T=1,...\n"
+          "      --bench-levels   time admissions on 1, 2, 4, ... levels "
+          "(up to -L or 16)\n"
+          "      --bench-admission\n"
+          "                       time one level's admissions with and "
+          "without the\n"
+          "                       fast path on 1, 2, 4 and 8 threads\n"
+          "      --no-fast-path   admit and release every vehicle under the "
+          "level lock\n"
+          "  -q, --quiet          only print the final summary\n",
+          prog, prog, prog, prog);
+}
+
+static void futex_wait(atomic_int *word, int expected) {
+  int op =
+      g_options.backend == BACKEND_PROCESS ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+  if (syscall(SYS_futex, word, op, expected, NULL, NULL, 0) == -1 &&
+      errno != EAGAIN && errno != EINTR) {
+    perror("futex wait");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void futex_wake(atomic_int *word, int count) {
+  int op =
+      g_options.backend == BACKEND_PROCESS ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+  if (syscall(SYS_futex, word, op, count, NULL, NULL, 0) == -1) {
+    perror("futex wake");
+    exit(EXIT_FAILURE);
+  }
 }
 
 static void safe_sem_wait(sem_t *sem) {
@@ -309,7 +2144,8 @@ static void safe_sem_post(sem_t *sem) {
 }
 
 static void safe_sem_init(sem_t *sem, unsigned int value) {
-  if (sem_init(sem, 1, value) == -1) {
+  int pshared = g_options.backend == BACKEND_PROCESS;
+  if (sem_init(sem, pshared, value) == -1) {
     perror("sem_init");
     exit(EXIT_FAILURE);
   }
@@ -1,15 +1,29 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_DESC_LEN 256
 #define LINE_BUFFER 512
+#define DEQUE_CAPACITY 256
+#define DEQUE_MASK (DEQUE_CAPACITY - 1)
+#define CACHE_LINE 64
+#define BENCH_MAX_WORKERS 64
+#define BENCH_TASK_ROUNDS 256
+#define DEFAULT_RING_BYTES (1u << 20)
+#define RING_SPIN_MAX 4096
 
 typedef struct {
   int task_id;
@@ -28,94 +42,249 @@ typedef struct {
   size_t count;
 } WorkQueue;
 
+typedef enum { QUEUE_STEAL, QUEUE_SHARED, QUEUE_RING } QueueKind;
+
+typedef struct {
+  QueueKind queue;
+  bool quiet;
+  bool micro;
+  size_t ring_slots;
+} Options;
+
+/*
+ * Chase-Lev work-stealing deque of DEQUE_CAPACITY task pointers. The owner
+ * pushes and takes at the bottom without a lock; other workers steal from
+ * the top with a compare-and-swap. top and bottom only grow, and a slot is
+ * their value modulo the capacity. The owner only pushes into an empty
+ * deque and never more than DEQUE_CAPACITY tasks (see refill_deque()), so
+ * the array never has to grow.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic int64_t top;
+  _Alignas(CACHE_LINE) _Atomic int64_t bottom;
+  _Alignas(CACHE_LINE) _Atomic(TaskNode *) slots[DEQUE_CAPACITY];
+} Deque;
+
+/*
+ * Bounded multi-producer, multi-consumer ring (Vyukov). Each slot carries a
+ * sequence number that says whose turn it is: a slot at position pos is
+ * free for the producer that claims pos while sequence == pos, and holds a
+ * task for the consumer that claims pos once sequence == pos + 1. Producers
+ * and consumers claim positions with a compare-and-swap on enqueue_pos and
+ * dequeue_pos, then copy the task in or out and hand the slot on by
+ * advancing its sequence. Tasks are copied into the slots, so the ring is
+ * the only allocation; its size is the memory ceiling (--max-memory).
+ */
+typedef struct {
+  _Atomic size_t sequence;
+  Task task;
+} RingSlot;
+
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic size_t enqueue_pos;
+  _Alignas(CACHE_LINE) _Atomic size_t dequeue_pos;
+  _Alignas(CACHE_LINE) RingSlot *slots;
+  size_t mask;
+} Ring;
+
+/* One pool thread; executed and stolen are only read after it is joined. */
+typedef struct {
+  Deque deque;
+  pthread_t thread;
+  int index;
+  uint64_t rng;
+  size_t executed;
+  size_t stolen;
+} Worker;
+
+static Options g_options = {QUEUE_STEAL, false, false, 0};
+
+/*
+ * The shared queue, and in steal mode the injection queue: the producer
+ * appends here and idle workers move batches of it into their deques.
+ */
 static WorkQueue queue = {NULL, NULL, 0};
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
 static bool shutdown_flag = false;
+static int idle_workers = 0;
+static size_t queue_locks = 0; /* times a worker locked queue_mutex */
+
+static Worker *workers = NULL;
+static int worker_count = 0;
+
+/*
+ * Ring waiters block on queue_mutex: consumers on queue_cond, producers on
+ * ring_not_full. The waiter counts let the other side skip the mutex when
+ * nobody sleeps. ring_spin is how many failed attempts a thread spins
+ * through before it blocks (see ring_adapt_spin()).
+ */
+static Ring ring;
+static pthread_cond_t ring_not_full = PTHREAD_COND_INITIALIZER;
+static _Atomic int ring_push_waiters = 0;
+static _Atomic int ring_pop_waiters = 0;
+static _Atomic int ring_spin = 64;
+static size_t ring_full_waits = 0; /* producer blocks on a full ring */
 
 static void enqueue_task(const Task *task);
 static bool dequeue_task(Task *task);
+static TaskNode *pop_node(void);
 static void signal_shutdown(void);
 static bool parse_task_line(const char *line, Task *task_out);
 static int parse_int_field(const char *text, int *value_out);
 static char *trim_whitespace(char *text);
 static void drain_queue(void);
+static int pool_start(int num_workers);
+static void pool_stop(size_t *executed, size_t *stolen);
+static int ring_create(size_t slots);
+static void ring_destroy(void);
+static bool ring_try_push(const Task *task);
+static bool ring_try_pop(Task *task);
+static void ring_push(const Task *task);
+static bool ring_pop(Task *task);
+static void ring_wake(_Atomic int *waiters, pthread_cond_t *cond);
+static void ring_adapt_spin(bool spun);
+static void cpu_relax(void);
+static int parse_size(const char *text, size_t *value_out);
+static void produce_file(FILE *fp);
+static void produce_micro(int count);
+static int bench_queues(int tasks);
+static double bench_run(QueueKind kind, int num_workers, int tasks,
+                        double *stolen_share, double *locks_per_task);
+static void run_task(const Task *task);
+static void deque_push(Deque *deque, TaskNode *node);
+static TaskNode *deque_take(Deque *deque);
+static TaskNode *deque_steal(Deque *deque, bool *contended);
+static bool deque_pending(void);
+static TaskNode *steal_task(Worker *self);
+static bool refill_deque(Worker *self, TaskNode **out);
+static uint64_t rng_next(uint64_t *state);
+static uint64_t now_ns(void);
+static void usage(const char *prog);
 
 static void *worker_thread(void *arg);
+static void *steal_worker_thread(void *arg);
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <number_of_worker_threads> <input_file>\n",
-            argv[0]);
+  static const struct option long_options[] = {
+      {"queue", required_argument, NULL, 'Q'},
+      {"max-memory", required_argument, NULL, 'm'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"bench", no_argument, NULL, 'B'},
+      {NULL, 0, NULL, 0},
+  };
+
+  bool bench = false;
+  size_t ring_bytes = DEFAULT_RING_BYTES;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "Q:m:q", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'Q':
+      if (strcmp(optarg, "steal") == 0) {
+        g_options.queue = QUEUE_STEAL;
+      } else if (strcmp(optarg, "shared") == 0) {
+        g_options.queue = QUEUE_SHARED;
+      } else if (strcmp(optarg, "ring") == 0) {
+        g_options.queue = QUEUE_RING;
+      } else {
+        fprintf(stderr, "Unknown queue: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm':
+      if (parse_size(optarg, &ring_bytes) != 0) {
+        fprintf(stderr, "Invalid memory size: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'q':
+      g_options.quiet = true;
+      break;
+    case 'B':
+      bench = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (bench) {
+    int tasks = 0;
+    if (argc - optind != 1 || parse_int_field(argv[optind], &tasks) != 0 ||
+        tasks <= 0) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    return bench_queues(tasks);
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   int num_workers = 0;
-  if (parse_int_field(argv[1], &num_workers) != 0 || num_workers <= 0) {
+  if (parse_int_field(argv[optind], &num_workers) != 0 || num_workers <= 0) {
     fprintf(stderr, "Number of worker threads must be a positive integer.\n");
     return EXIT_FAILURE;
   }
 
-  FILE *fp = fopen(argv[2], "r");
+  /* The largest power of two that fits: ring positions wrap with a mask. */
+  g_options.ring_slots = 1;
+  while (g_options.ring_slots * 2 <= ring_bytes / sizeof(RingSlot)) {
+    g_options.ring_slots *= 2;
+  }
+  if (g_options.queue == QUEUE_RING && ring_bytes / sizeof(RingSlot) < 2) {
+    fprintf(stderr, "--max-memory must fit at least 2 tasks (%zu bytes)\n",
+            2 * sizeof(RingSlot));
+    return EXIT_FAILURE;
+  }
+
+  FILE *fp = fopen(argv[optind + 1], "r");
   if (!fp) {
     perror("fopen");
     return EXIT_FAILURE;
   }
 
-  pthread_t *workers = calloc((size_t)num_workers, sizeof(*workers));
-  if (!workers) {
-    perror("calloc");
+  uint64_t start_ns = now_ns();
+  if ((g_options.queue == QUEUE_RING &&
+       ring_create(g_options.ring_slots) != 0) ||
+      pool_start(num_workers) != 0) {
     fclose(fp);
     return EXIT_FAILURE;
   }
-
-  int created_workers = 0;
-  for (int i = 0; i < num_workers; i++) {
-    if (pthread_create(&workers[i], NULL, worker_thread, NULL) != 0) {
-      perror("pthread_create");
-      signal_shutdown();
-      created_workers = i;
-      fclose(fp);
-      for (int j = 0; j < created_workers; j++) {
-        pthread_join(workers[j], NULL);
-      }
-      free(workers);
-      return EXIT_FAILURE;
-    }
-    created_workers++;
-  }
-
-  char line[LINE_BUFFER];
-  while (fgets(line, sizeof(line), fp)) {
-    line[strcspn(line, "\r\n")] = '\0';
-    if (line[0] == '\0') {
-      continue;
-    }
-    Task task;
-    if (!parse_task_line(line, &task)) {
-      fprintf(stderr, "Skipping malformed task: %s\n", line);
-      continue;
-    }
-    enqueue_task(&task);
-  }
-
+  produce_file(fp);
   fclose(fp);
-  signal_shutdown();
-
-  for (int i = 0; i < created_workers; i++) {
-    pthread_join(workers[i], NULL);
-  }
 
-  free(workers);
-  drain_queue();
+  size_t executed = 0;
+  size_t stolen = 0;
+  pool_stop(&executed, &stolen);
+  ring_destroy();
   pthread_mutex_destroy(&queue_mutex);
   pthread_cond_destroy(&queue_cond);
+  pthread_cond_destroy(&ring_not_full);
 
-  printf("All tasks processed. Exiting.\n");
+  printf("%zu tasks on %d workers in %.3f s", executed, num_workers,
+         (double)(now_ns() - start_ns) / 1e9);
+  if (g_options.queue == QUEUE_STEAL) {
+    printf(", %zu stolen", stolen);
+  } else if (g_options.queue == QUEUE_RING) {
+    printf(", %zu-slot ring (%zu bytes), producer blocked %zu times",
+           g_options.ring_slots, g_options.ring_slots * sizeof(RingSlot),
+           ring_full_waits);
+  }
+  printf("\nAll tasks processed. Exiting.\n");
   return EXIT_SUCCESS;
 }
 
 static void enqueue_task(const Task *task) {
+  if (g_options.queue == QUEUE_RING) {
+    ring_push(task);
+    return;
+  }
+
   TaskNode *node = malloc(sizeof(*node));
   if (!node) {
     perror("malloc");
@@ -132,14 +301,23 @@ static void enqueue_task(const Task *task) {
   }
   queue.tail = node;
   queue.count++;
-  pthread_cond_signal(&queue_cond);
+  if (idle_workers > 0) {
+    pthread_cond_signal(&queue_cond);
+  }
   pthread_mutex_unlock(&queue_mutex);
 }
 
 static bool dequeue_task(Task *task) {
+  if (g_options.queue == QUEUE_RING) {
+    return ring_pop(task);
+  }
+
   pthread_mutex_lock(&queue_mutex);
+  queue_locks++;
   while (queue.count == 0 && !shutdown_flag) {
+    idle_workers++;
     pthread_cond_wait(&queue_cond, &queue_mutex);
+    idle_workers--;
   }
 
   if (queue.count == 0 && shutdown_flag) {
@@ -147,17 +325,23 @@ static bool dequeue_task(Task *task) {
     return false;
   }
 
-  TaskNode *node = queue.head;
+  TaskNode *node = pop_node();
+  pthread_mutex_unlock(&queue_mutex);
+
   *task = node->task;
+  free(node);
+  return true;
+}
+
+/* Unlinks the oldest node; queue_mutex is held and the queue is not empty. */
+static TaskNode *pop_node(void) {
+  TaskNode *node = queue.head;
   queue.head = node->next;
   if (!queue.head) {
     queue.tail = NULL;
   }
   queue.count--;
-  pthread_mutex_unlock(&queue_mutex);
-
-  free(node);
-  return true;
+  return node;
 }
 
 static void signal_shutdown(void) {
@@ -246,19 +430,618 @@ static void drain_queue(void) {
   pthread_mutex_unlock(&queue_mutex);
 }
 
+/*
+ * Starts num_workers threads on an empty queue. On failure the threads
+ * already started are shut down again and -1 is returned.
+ */
+static int pool_start(int num_workers) {
+  workers = aligned_alloc(CACHE_LINE, (size_t)num_workers * sizeof(*workers));
+  if (!workers) {
+    perror("aligned_alloc");
+    return -1;
+  }
+  shutdown_flag = false;
+  idle_workers = 0;
+  queue_locks = 0;
+  ring_full_waits = 0;
+  worker_count = num_workers;
+  uint64_t seed = now_ns();
+  for (int i = 0; i < num_workers; i++) {
+    Worker *worker = &workers[i];
+    atomic_init(&worker->deque.top, 0);
+    atomic_init(&worker->deque.bottom, 0);
+    worker->index = i;
+    worker->rng = seed + (uint64_t)i;
+    worker->executed = 0;
+    worker->stolen = 0;
+  }
+
+  void *(*entry)(void *) = g_options.queue == QUEUE_STEAL
+                               ? steal_worker_thread
+                               : worker_thread;
+  for (int i = 0; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, entry, &workers[i]) != 0) {
+      perror("pthread_create");
+      worker_count = i;
+      pool_stop(NULL, NULL);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Lets the workers finish every queued task, joins them and adds up what
+ * they did (either pointer may be NULL).
+ */
+static void pool_stop(size_t *executed, size_t *stolen) {
+  signal_shutdown();
+  size_t executed_sum = 0;
+  size_t stolen_sum = 0;
+  for (int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    executed_sum += workers[i].executed;
+    stolen_sum += workers[i].stolen;
+  }
+  drain_queue();
+  free(workers);
+  workers = NULL;
+  worker_count = 0;
+  if (executed) {
+    *executed = executed_sum;
+  }
+  if (stolen) {
+    *stolen = stolen_sum;
+  }
+}
+
+/* Allocates an empty ring of `slots` (a power of two) task slots. */
+static int ring_create(size_t slots) {
+  ring.slots = aligned_alloc(CACHE_LINE, slots * sizeof(*ring.slots));
+  if (!ring.slots) {
+    perror("aligned_alloc");
+    return -1;
+  }
+  ring.mask = slots - 1;
+  for (size_t i = 0; i < slots; i++) {
+    atomic_init(&ring.slots[i].sequence, i);
+  }
+  atomic_init(&ring.enqueue_pos, 0);
+  atomic_init(&ring.dequeue_pos, 0);
+  return 0;
+}
+
+static void ring_destroy(void) {
+  free(ring.slots);
+  ring.slots = NULL;
+}
+
+/* Copies the task into the next free slot; false if the ring is full. */
+static bool ring_try_push(const Task *task) {
+  size_t pos = atomic_load_explicit(&ring.enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    RingSlot *slot = &ring.slots[pos & ring.mask];
+    size_t sequence =
+        atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring.enqueue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->task = *task;
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring.enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+/* Copies the oldest task out of the ring; false if it is empty. */
+static bool ring_try_pop(Task *task) {
+  size_t pos = atomic_load_explicit(&ring.dequeue_pos, memory_order_relaxed);
+  for (;;) {
+    RingSlot *slot = &ring.slots[pos & ring.mask];
+    size_t sequence =
+        atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring.dequeue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *task = slot->task;
+        atomic_store_explicit(&slot->sequence, pos + ring.mask + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring.dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Backpressure: a producer that finds the ring full spins for a while and
+ * then sleeps on ring_not_full until a consumer frees a slot.
+ */
+static void ring_push(const Task *task) {
+  int spin = atomic_load_explicit(&ring_spin, memory_order_relaxed);
+  for (int i = 0; i <= spin; i++) {
+    if (ring_try_push(task)) {
+      if (i > 0) {
+        ring_adapt_spin(true);
+      }
+      ring_wake(&ring_pop_waiters, &queue_cond);
+      return;
+    }
+    cpu_relax();
+  }
+  ring_adapt_spin(false);
+
+  pthread_mutex_lock(&queue_mutex);
+  atomic_fetch_add(&ring_push_waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!ring_try_push(task)) {
+    ring_full_waits++;
+    pthread_cond_wait(&ring_not_full, &queue_mutex);
+  }
+  atomic_fetch_sub(&ring_push_waiters, 1);
+  pthread_mutex_unlock(&queue_mutex);
+  ring_wake(&ring_pop_waiters, &queue_cond);
+}
+
+/*
+ * Takes the oldest task, spinning and then sleeping on queue_cond while the
+ * ring is empty. Returns false once shutdown has been signalled and the
+ * ring is empty: the producer has pushed its last task by then.
+ */
+static bool ring_pop(Task *task) {
+  int spin = atomic_load_explicit(&ring_spin, memory_order_relaxed);
+  for (int i = 0; i <= spin; i++) {
+    if (ring_try_pop(task)) {
+      if (i > 0) {
+        ring_adapt_spin(true);
+      }
+      ring_wake(&ring_push_waiters, &ring_not_full);
+      return true;
+    }
+    cpu_relax();
+  }
+  ring_adapt_spin(false);
+
+  bool popped = true;
+  pthread_mutex_lock(&queue_mutex);
+  queue_locks++;
+  atomic_fetch_add(&ring_pop_waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!ring_try_pop(task)) {
+    if (shutdown_flag) {
+      popped = false;
+      break;
+    }
+    pthread_cond_wait(&queue_cond, &queue_mutex);
+  }
+  atomic_fetch_sub(&ring_pop_waiters, 1);
+  pthread_mutex_unlock(&queue_mutex);
+  if (popped) {
+    ring_wake(&ring_push_waiters, &ring_not_full);
+  }
+  return popped;
+}
+
+/*
+ * Called after a push or pop: wakes one thread of the other side if any
+ * sleeps. The fence pairs with the one a waiter issues after registering,
+ * so either the waiter's retry sees this slot or this load sees the waiter;
+ * the signal is sent under queue_mutex, so it cannot fall between the
+ * waiter's retry and its wait.
+ */
+static void ring_wake(_Atomic int *waiters, pthread_cond_t *cond) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiters, memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&queue_mutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&queue_mutex);
+  }
+}
+
+/*
+ * Spinning pays off only when the other side runs at the same time, on
+ * another core. Every wait that spinning ended doubles the spin budget;
+ * every wait that had to block anyway halves it. On a single core the
+ * budget falls to zero and threads block straight away.
+ */
+static void ring_adapt_spin(bool spun) {
+  int spin = atomic_load_explicit(&ring_spin, memory_order_relaxed);
+  spin = spun ? spin * 2 + 1 : spin / 2;
+  if (spin > RING_SPIN_MAX) {
+    spin = RING_SPIN_MAX;
+  }
+  atomic_store_explicit(&ring_spin, spin, memory_order_relaxed);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  sched_yield();
+#endif
+}
+
+/* Parses a byte count with an optional K, M or G suffix (powers of 1024). */
+static int parse_size(const char *text, size_t *value_out) {
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  char *end = NULL;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || text[0] == '-') {
+    return -1;
+  }
+  int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+  if (shift > 0 && end[1] != '\0') {
+    return -1;
+  }
+  if (value > (SIZE_MAX >> shift)) {
+    return -1;
+  }
+  *value_out = (size_t)(value << shift);
+  return 0;
+}
+
+static void produce_file(FILE *fp) {
+  char line[LINE_BUFFER];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+      continue;
+    }
+    Task task;
+    if (!parse_task_line(line, &task)) {
+      fprintf(stderr, "Skipping malformed task: %s\n", line);
+      continue;
+    }
+    enqueue_task(&task);
+  }
+}
+
+static void produce_micro(int count) {
+  Task task = {0, "micro", 0};
+  for (int i = 0; i < count; i++) {
+    task.task_id = i + 1;
+    enqueue_task(&task);
+  }
+}
+
+/*
+ * Queue benchmark: `tasks` micro-tasks (a few hundred nanoseconds of
+ * arithmetic each, no sleeping) are queued up front, so the producer is
+ * not what is timed, then 1, 2, 4, ... BENCH_MAX_WORKERS workers run them,
+ * once per queue. The ring is sized to hold all of them for this. Reports
+ * tasks per second, the share of tasks stolen, and how often a worker took
+ * queue_mutex per task (shared/steal/ring).
+ */
+static int bench_queues(int tasks) {
+  g_options.quiet = true;
+  g_options.micro = true;
+  g_options.ring_slots = 2;
+  while (g_options.ring_slots < (size_t)tasks) {
+    g_options.ring_slots *= 2;
+  }
+  printf("%7s %12s %12s %12s %8s %17s\n", "workers", "shared/s", "steal/s",
+         "ring/s", "stolen", "locks/task");
+  for (int num_workers = 1; num_workers <= BENCH_MAX_WORKERS;
+       num_workers *= 2) {
+    double stolen_share = 0.0;
+    double locks_shared = 0.0;
+    double locks_steal = 0.0;
+    double locks_ring = 0.0;
+    double shared =
+        bench_run(QUEUE_SHARED, num_workers, tasks, NULL, &locks_shared);
+    double ring_rate =
+        bench_run(QUEUE_RING, num_workers, tasks, NULL, &locks_ring);
+    double steal = bench_run(QUEUE_STEAL, num_workers, tasks, &stolen_share,
+                             &locks_steal);
+    if (shared < 0.0 || steal < 0.0 || ring_rate < 0.0) {
+      return EXIT_FAILURE;
+    }
+    printf("%7d %12.0f %12.0f %12.0f %7.1f%% %5.2f/%.3f/%.3f\n", num_workers,
+           shared, steal, ring_rate, stolen_share * 100.0, locks_shared,
+           locks_steal, locks_ring);
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+ * One benchmark configuration; returns tasks per second, or -1, and stores
+ * the stolen share (unless stolen_share is NULL) and the queue_mutex
+ * acquisitions per task.
+ */
+static double bench_run(QueueKind kind, int num_workers, int tasks,
+                        double *stolen_share, double *locks_per_task) {
+  g_options.queue = kind;
+  if (kind == QUEUE_RING && ring_create(g_options.ring_slots) != 0) {
+    return -1.0;
+  }
+  produce_micro(tasks);
+  uint64_t start_ns = now_ns();
+  if (pool_start(num_workers) != 0) {
+    ring_destroy();
+    return -1.0;
+  }
+  size_t executed = 0;
+  size_t stolen = 0;
+  pool_stop(&executed, &stolen);
+  ring_destroy();
+  double seconds = (double)(now_ns() - start_ns) / 1e9;
+  double tasks_done = executed > 0 ? (double)executed : 1.0;
+  if (stolen_share) {
+    *stolen_share = (double)stolen / tasks_done;
+  }
+  *locks_per_task = (double)queue_locks / tasks_done;
+  return (double)executed / seconds;
+}
+
+static void run_task(const Task *task) {
+  if (g_options.micro) {
+    uint64_t state = (uint64_t)task->task_id;
+    for (int i = 0; i < BENCH_TASK_ROUNDS; i++) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+    }
+    volatile uint64_t sink = state;
+    (void)sink;
+    return;
+  }
+
+  if (!g_options.quiet) {
+    printf("[Worker %lu] Processing Task %d: %s (Duration: %d sec)\n",
+           (unsigned long)pthread_self(), task->task_id, task->description,
+           task->duration);
+  }
+  sleep((unsigned int)task->duration);
+  if (!g_options.quiet) {
+    printf("[Worker %lu] Completed Task %d\n", (unsigned long)pthread_self(),
+           task->task_id);
+  }
+}
+
+/*
+ * Owner only. The new bottom is a release store, so a thief that sees it
+ * (with an acquire load) also sees the slot and the task behind it.
+ */
+static void deque_push(Deque *deque, TaskNode *node) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  atomic_store_explicit(&deque->slots[bottom & DEQUE_MASK], node,
+                        memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+/*
+ * Owner only: takes the newest task, or returns NULL when the deque is
+ * empty. Claiming the bottom slot first and then reading top (with a full
+ * fence between) means a thief can only compete for the last task, which
+ * both sides then claim with a compare-and-swap on top.
+ */
+static TaskNode *deque_take(Deque *deque) {
+  int64_t bottom =
+      atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  TaskNode *node = atomic_load_explicit(&deque->slots[bottom & DEQUE_MASK],
+                                        memory_order_relaxed);
+  if (top == bottom) {
+    if (!atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst,
+            memory_order_relaxed)) {
+      node = NULL;
+    }
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return node;
+}
+
+/*
+ * Any thread: takes the oldest task. Returns NULL when the deque is empty,
+ * or when another thread claimed the same task first (*contended is set
+ * then, and the caller may retry).
+ */
+static TaskNode *deque_steal(Deque *deque, bool *contended) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  TaskNode *node = atomic_load_explicit(&deque->slots[top & DEQUE_MASK],
+                                        memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    *contended = true;
+    return NULL;
+  }
+  return node;
+}
+
+/* True if any worker's deque holds a task another worker could steal. */
+static bool deque_pending(void) {
+  for (int i = 0; i < worker_count; i++) {
+    Deque *deque = &workers[i].deque;
+    if (atomic_load(&deque->bottom) > atomic_load(&deque->top)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Tries every other worker once, starting at a random one so thieves spread
+ * out instead of all hitting worker 0. Sweeps again while some steal lost a
+ * race, since the deque it lost on may still have tasks.
+ */
+static TaskNode *steal_task(Worker *self) {
+  if (worker_count < 2) {
+    return NULL;
+  }
+  bool contended;
+  do {
+    contended = false;
+    int start = (int)(rng_next(&self->rng) % (uint64_t)worker_count);
+    for (int i = 0; i < worker_count; i++) {
+      Worker *victim = &workers[(start + i) % worker_count];
+      if (victim == self) {
+        continue;
+      }
+      TaskNode *node = deque_steal(&victim->deque, &contended);
+      if (node) {
+        self->stolen++;
+        return node;
+      }
+    }
+  } while (contended);
+  return NULL;
+}
+
+/*
+ * Called with an empty deque once stealing has failed. Waits for work,
+ * then moves a fair share of the injection queue (its length divided by the
+ * number of workers, plus one, at most DEQUE_CAPACITY) into the deque under
+ * a single lock, and wakes idle workers to steal from it. Stores the first
+ * task in *out, or NULL when there was only something to steal. Returns
+ * false once shutdown has been signalled and no task is left anywhere.
+ */
+static bool refill_deque(Worker *self, TaskNode **out) {
+  *out = NULL;
+  pthread_mutex_lock(&queue_mutex);
+  queue_locks++;
+  while (queue.count == 0 && !shutdown_flag && !deque_pending()) {
+    idle_workers++;
+    pthread_cond_wait(&queue_cond, &queue_mutex);
+    idle_workers--;
+  }
+
+  bool more = true;
+  if (queue.count > 0) {
+    size_t batch = queue.count / (size_t)worker_count + 1;
+    if (batch > queue.count) {
+      batch = queue.count;
+    }
+    if (batch > DEQUE_CAPACITY) {
+      batch = DEQUE_CAPACITY;
+    }
+    *out = pop_node();
+    for (size_t i = 1; i < batch; i++) {
+      deque_push(&self->deque, pop_node());
+    }
+    int wake = idle_workers < (int)batch - 1 ? idle_workers : (int)batch - 1;
+    for (int i = 0; i < wake; i++) {
+      pthread_cond_signal(&queue_cond);
+    }
+  } else if (!deque_pending()) {
+    more = false;
+  }
+  pthread_mutex_unlock(&queue_mutex);
+  return more;
+}
+
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <number_of_worker_threads> <input_file>\n"
+          "       %s --bench <number_of_tasks>\n"
+          "  -Q, --queue KIND   steal (per-worker deques, default), shared "
+          "(one locked list)\n"
+          "                     or ring (bounded lock-free ring)\n"
+          "  -m, --max-memory SIZE\n"
+          "                     memory ceiling of the ring, K/M/G suffixes "
+          "(default 1M)\n"
+          "  -q, --quiet        only print the final summary\n"
+          "      --bench        time micro-tasks on 1, 2, 4, ... 64 workers "
+          "with each queue\n",
+          prog, prog);
+}
+
 static void *worker_thread(void *arg) {
-  (void)arg;
+  Worker *self = arg;
   Task task;
 
   while (dequeue_task(&task)) {
-    printf("[Worker %lu] Processing Task %d: %s (Duration: %d sec)\n",
-           (unsigned long)pthread_self(), task.task_id, task.description,
-           task.duration);
-    sleep(task.duration);
-    printf("[Worker %lu] Completed Task %d\n", (unsigned long)pthread_self(),
-           task.task_id);
+    run_task(&task);
+    self->executed++;
+  }
+
+  if (!g_options.quiet) {
+    printf("[Worker %lu] Shutting down.\n", (unsigned long)pthread_self());
+  }
+  return NULL;
+}
+
+/*
+ * Steal-mode worker: its own deque first (newest task, still warm in the
+ * cache), then the other workers' deques (oldest tasks), and only then the
+ * injection queue behind queue_mutex.
+ */
+static void *steal_worker_thread(void *arg) {
+  Worker *self = arg;
+
+  for (;;) {
+    TaskNode *node = deque_take(&self->deque);
+    if (!node) {
+      node = steal_task(self);
+    }
+    if (!node && !refill_deque(self, &node)) {
+      break;
+    }
+    if (!node) {
+      continue;
+    }
+    run_task(&node->task);
+    free(node);
+    self->executed++;
   }
 
-  printf("[Worker %lu] Shutting down.\n", (unsigned long)pthread_self());
+  if (!g_options.quiet) {
+    printf("[Worker %lu] Shutting down.\n", (unsigned long)pthread_self());
+  }
   return NULL;
 }